@@ -18,281 +18,2814 @@
 #include <unordered_map>
 #include <unordered_set>
 #include <memory>
+#include <random>
 
 using namespace std;
 #endif /* __PROGTEST__ */
 
+// not in the Progtest header set, the code outside of the tests needs them in both builds
+#include <cstdint>
+#include <string_view>
+#include <type_traits>
+#include <mutex>
+#include <condition_variable>
+#include <shared_mutex>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <chrono>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#define DU5_FSYNC(file) fsync(fileno(file))
+#else
+#define DU5_FSYNC(file) 0 // fflush() is all we can do here
+#endif
+
+/**
+ * @brief Class implementing comparison between two dates.
+ *
+ * For comparing dates we should overload at least two operators(in our case "<" and "==") as we can evaluate the third
+ * operator(">") just by using else statement. The date is packed into a single day number (days since 1970-01-01 in the
+ * proleptic Gregorian calendar), so both operators are one integer comparison and the class is only 4 bytes large.
+ * Year, month and day are computed back only when somebody asks for them.
+ */
+class CDate
+{
+
+public:
+  // ~СDate
+  /*
+   * We do not need a destructor: When CDate object gets destructed, the default destructor is called.
+   * This destructor calls destructor of every attribute of the class (int day_number).
+   * Integers don`t have to be implicitly deallocated.
+   */
+
+  // parameterized constructor, packs the date into the day number. An invalid date would alias a valid one
+  // (2020-02-30 packs to 2020-03-01), so it is rejected by an assert, parse() filters untrusted input first
+  constexpr CDate(int y, int m, int d) : day_number((assert(isValid(y, m, d)), daysFromCivil(y, m, d))){};
+
+  constexpr int getYear() const { return civilFromDays(day_number).year; }
+  constexpr int getMonth() const { return civilFromDays(day_number).month; }
+  constexpr int getDay() const { return civilFromDays(day_number).day; }
+
+  /** @brief returns the date shifted by the given (possibly negative) number of days */
+  constexpr CDate addDays(int days) const
+  {
+    return fromDayNumber(day_number + days);
+  }
+
+  /** @brief returns the number of days from t to this date, negative if t is later */
+  constexpr int operator-(const CDate &t) const
+  {
+    return day_number - t.day_number;
+  }
+
+  /**
+   * @brief overloaded operator two compare contents of CDate classes
+   *
+   * @param[in] t object to compare
+   * @returns  true if lvalue is lower than rvalue, or else if lvalue is bigger than rvalue
+   */
+  constexpr bool operator<(const CDate &t) const
+  {
+    return day_number < t.day_number;
+  }
+
+  // same logic as in the overloaded operator before
+  constexpr bool operator==(const CDate &t) const
+  {
+    return day_number == t.day_number;
+  }
+
+  /** @brief checks that the month is 1-12 and the day exists in that month */
+  static constexpr bool isValid(int y, int m, int d)
+  {
+    return m >= 1 && m <= 12 && d >= 1 && d <= daysInMonth(y, m);
+  }
+
+  /**
+   * @brief Parses a date in the "YYYY-MM-DD" format without iostreams.
+   *
+   * @param[in] text pointer to the first character of the date, does not have to be null terminated
+   * @param[in] length number of characters to parse, has to be exactly 10
+   * @param[out] date parsed date, left untouched on failure
+   *
+   * @returns true if the text is a well formed and valid date, otherwise returns false
+   */
+  static bool parse(const char *text, size_t length, CDate &date)
+  {
+    if (length != 10 || text[4] != '-' || text[7] != '-')
+      return false;
+    int parts[3] = {0, 0, 0};
+    const size_t part_begin[3] = {0, 5, 8}, part_end[3] = {4, 7, 10};
+    for (int part = 0; part < 3; part++)
+      for (size_t pos = part_begin[part]; pos < part_end[part]; pos++)
+      {
+        if (text[pos] < '0' || text[pos] > '9')
+          return false;
+        parts[part] = parts[part] * 10 + (text[pos] - '0');
+      }
+    if (!isValid(parts[0], parts[1], parts[2]))
+      return false;
+    date = CDate(parts[0], parts[1], parts[2]);
+    return true;
+  }
+
+  static bool parse(const string &text, CDate &date)
+  {
+    return parse(text.data(), text.size(), date);
+  }
+
+private:
+  /** @brief helper struct for unpacking the day number */
+  struct CCivil
+  {
+    int year, month, day;
+  };
+
+  static constexpr CDate fromDayNumber(int days)
+  {
+    CDate date(1970, 1, 1);
+    date.day_number = days;
+    return date;
+  }
+
+  static constexpr bool isLeap(int y)
+  {
+    return (y % 4 == 0 && y % 100 != 0) || y % 400 == 0;
+  }
+
+  static constexpr int daysInMonth(int y, int m)
+  {
+    return m == 2 ? (isLeap(y) ? 29 : 28) : (m == 4 || m == 6 || m == 9 || m == 11 ? 30 : 31);
+  }
+
+  /*
+   * Conversion between the calendar and the day number, taken from Howard Hinnant`s "chrono-Compatible Low-Level Date
+   * Algorithms". Years are shifted to begin in March, so the leap day is the last day of the shifted year.
+   */
+  static constexpr int daysFromCivil(int y, int m, int d)
+  {
+    y -= m <= 2;
+    const int era = (y >= 0 ? y : y - 399) / 400;
+    const int year_of_era = y - era * 400;                                    // [0, 399]
+    const int day_of_year = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1; // [0, 365]
+    const int day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+    return era * 146097 + day_of_era - 719468;
+  }
+
+  static constexpr CCivil civilFromDays(int days)
+  {
+    days += 719468;
+    const int era = (days >= 0 ? days : days - 146096) / 146097;
+    const int day_of_era = days - era * 146097;
+    const int year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524 - day_of_era / 146096) / 365;
+    const int day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+    const int shifted_month = (5 * day_of_year + 2) / 153;
+    const int month = shifted_month < 10 ? shifted_month + 3 : shifted_month - 9;
+    return CCivil{year_of_era + era * 400 + (month <= 2), month, day_of_year - (153 * shifted_month + 2) / 5 + 1};
+  }
+
+  int day_number;
+};
+
+/**
+ * @brief Pool of interned product names.
+ *
+ * Every name is stored once and gets a compact id, which is used in all internal structures of CSupermarket instead of
+ * the name itself. Names are looked up by string_view, so searching for a name never allocates. Ids of released names
+ * are reused, so the ids stay dense and can index a plain vector.
+ */
+class CNamePool
+{
+public:
+  static const uint32_t NOT_FOUND = UINT32_MAX;
+
+  CNamePool() = default;
+  // views in ids point into names, so a copy has to point them into its own strings
+  CNamePool(const CNamePool &src) : names(src.names), free_ids(src.free_ids)
+  {
+    ids.reserve(src.ids.size());
+    for (auto const &name : src.ids)
+      ids.emplace(string_view(names[name.second]), name.second);
+  }
+  CNamePool(CNamePool &&src) = default;
+  CNamePool &operator=(CNamePool src)
+  {
+    names.swap(src.names); // swapping a deque keeps its strings in place, so the views stay valid
+    free_ids.swap(src.free_ids);
+    ids.swap(src.ids);
+    return *this;
+  }
+
+  /** @returns id of the name or NOT_FOUND */
+  uint32_t find(string_view name) const
+  {
+    auto id = ids.find(name);
+    return id == ids.end() ? NOT_FOUND : id->second;
+  }
+
+  /** @brief adds a name which is not in the pool yet, the string is moved into the pool. @returns id of the name */
+  uint32_t add(string &&name)
+  {
+    uint32_t id;
+    if (!free_ids.empty())
+    {
+      id = free_ids.back();
+      free_ids.pop_back();
+      names[id] = move(name);
+    }
+    else
+    {
+      id = names.size();
+      names.push_back(move(name));
+    }
+    ids.emplace(string_view(names[id]), id);
+    return id;
+  }
+
+  /** @brief removes the name from the pool, its id will be given to one of the next added names */
+  void release(uint32_t id)
+  {
+    ids.erase(string_view(names[id]));
+    string().swap(names[id]);
+    free_ids.push_back(id);
+  }
+
+  const string &name(uint32_t id) const { return names[id]; }
+  size_t size() const { return ids.size(); }
+  size_t buckets() const { return ids.bucket_count(); }
+  void reserve(size_t count) { ids.reserve(count); }
+
+  /** @brief number of ids, released ones included */
+  size_t slots() const { return names.size(); }
+  const vector<uint32_t> &freeIds() const { return free_ids; }
+
+  /**
+   * @brief Replaces the pool by the given ids, used to restore a snapshot with the same ids.
+   * @param[in] slots id -> name, names of released ids are ignored
+   * @param[in] released released ids in the order in which they will be reused (from the back)
+   */
+  void assign(deque<string> &&slots, vector<uint32_t> &&released)
+  {
+    names = move(slots);
+    free_ids = move(released);
+    vector<bool> is_free(names.size());
+    for (uint32_t id : free_ids)
+    {
+      is_free[id] = true;
+      string().swap(names[id]);
+    }
+    ids.clear();
+    ids.reserve(names.size() - free_ids.size());
+    for (uint32_t id = 0; id < names.size(); id++)
+      if (!is_free[id])
+        ids.emplace(string_view(names[id]), id);
+  }
+
+private:
+  deque<string> names; // id -> name, deque never moves its elements, so views into them stay valid
+  vector<uint32_t> free_ids;
+  unordered_map<string_view, uint32_t> ids;
+};
+
+/**
+ * @brief Append-only log of the changes of a CSupermarket, see CSupermarket::openLog().
+ *
+ * Records are collected in a buffer and written with one write and one fsync once the buffer holds group_bytes (group
+ * commit), or when sync() is called. A crash loses only the records which were not synced yet. Every record has a
+ * checksum, so replay() recognizes a record torn by a crash and stops in front of it. A copy of a log is closed, as
+ * two markets must not append to one file.
+ */
+class COperationLog
+{
+public:
+  /** @brief effects of store() and sell() on the batches, every one of them is replayed by a single step */
+  enum EOperation : uint32_t
+  {
+    STORE = 1, // store(name, date, count)
+    TAKE,      // count items sold from the oldest batch, which is dated date and stays
+    POP,       // the oldest batch, dated date, is sold out
+    ERASE      // the product is sold out and erased
+  };
+
+  COperationLog() = default;
+  COperationLog(const COperationLog &) {}
+  COperationLog(COperationLog &&src) noexcept { swap(src); }
+  COperationLog &operator=(const COperationLog &)
+  {
+    close();
+    return *this;
+  }
+  COperationLog &operator=(COperationLog &&src) noexcept
+  {
+    close();
+    swap(src);
+    return *this;
+  }
+  ~COperationLog() { close(); }
+
+  /** @brief opens the log for appending, records which are there already are kept. @returns false on failure */
+  bool open(const string &path, size_t group_bytes)
+  {
+    close();
+    file = fopen(path.c_str(), "ab");
+    if (!file || fseek(file, 0, SEEK_END) != 0)
+    {
+      close();
+      return false;
+    }
+    synced = ftell(file);
+    group = group_bytes;
+    return true;
+  }
+  bool isOpen() const { return file != nullptr; }
+  /** @brief flushes the buffer (if any) and closes the file */
+  bool close()
+  {
+    if (!file)
+      return true;
+    bool written = sync();
+    written = fclose(file) == 0 && written;
+    file = nullptr;
+    buffer.clear();
+    return written;
+  }
+
+  void append(EOperation operation, string_view name, int day, int count)
+  {
+    if (!file)
+      return;
+    uint32_t fields[5] = {0, (uint32_t)name.size(), operation, (uint32_t)day, (uint32_t)count};
+    size_t begin = buffer.size();
+    buffer.append(reinterpret_cast<const char *>(fields), sizeof(fields));
+    buffer.append(name);
+    uint32_t checksum = recordChecksum(buffer.data() + begin + sizeof(uint32_t), buffer.size() - begin - sizeof(uint32_t));
+    memcpy(&buffer[begin], &checksum, sizeof(checksum));
+    if (buffer.size() >= group)
+      sync();
+  }
+
+  /** @brief writes the buffered records and waits until they are on the disk. @returns false on failure */
+  bool sync()
+  {
+    if (!file)
+      return false;
+    if (buffer.empty())
+      return true;
+    bool written = fwrite(buffer.data(), 1, buffer.size(), file) == buffer.size() && fflush(file) == 0 &&
+                   DU5_FSYNC(file) == 0;
+    if (written)
+      synced += buffer.size();
+    buffer.clear();
+    return written;
+  }
+
+  /** @brief size of the log file up to the last synced record */
+  uint64_t syncedSize() const { return synced; }
+
+  /**
+   * @brief Calls apply(operation, name, day, count) for every record of the log behind offset.
+   *
+   * Stops at the end of the file, at a torn or corrupted record or when apply() returns false. The log is cut behind
+   * the last applied record, so the records appended after a recovery follow right after it.
+   *
+   * @returns false if apply() failed or the log could not be read, a torn end of the log is not an error
+   */
+  template <typename F_>
+  static bool replay(const string &path, uint64_t offset, F_ apply)
+  {
+    FILE *log = fopen(path.c_str(), "rb");
+    if (!log)
+      return offset == 0; // no log yet
+    string contents;
+    char chunk[1 << 16];
+    for (size_t got; (got = fread(chunk, 1, sizeof(chunk), log)) > 0;)
+      contents.append(chunk, got);
+    fclose(log);
+    if (contents.size() < offset)
+      return false;
+
+    size_t position = offset;
+    bool applied = true;
+    while (contents.size() - position >= 5 * sizeof(uint32_t))
+    {
+      uint32_t fields[5];
+      memcpy(fields, contents.data() + position, sizeof(fields));
+      size_t length = sizeof(fields) + fields[1];
+      if (contents.size() - position < length ||
+          recordChecksum(contents.data() + position + sizeof(uint32_t), length - sizeof(uint32_t)) != fields[0])
+        break; // torn by a crash
+      if (!apply((EOperation)fields[2], string_view(contents.data() + position + sizeof(fields), fields[1]),
+                 (int)fields[3], (int)fields[4]))
+      {
+        applied = false;
+        break;
+      }
+      position += length;
+    }
+#if defined(__unix__) || defined(__APPLE__)
+    if (applied && position != contents.size() && truncate(path.c_str(), position) != 0)
+      return false;
+#endif
+    return applied;
+  }
+
+private:
+  static uint32_t recordChecksum(const char *data, size_t length)
+  {
+    uint32_t hash = 2166136261u; // FNV-1a
+    for (size_t pos = 0; pos < length; pos++)
+      hash = (hash ^ (unsigned char)data[pos]) * 16777619u;
+    return hash;
+  }
+
+  void swap(COperationLog &other)
+  {
+    std::swap(file, other.file);
+    std::swap(group, other.group);
+    std::swap(synced, other.synced);
+    buffer.swap(other.buffer);
+  }
+
+  FILE *file = nullptr;
+  size_t group = 0;    // the buffer is synced once it holds this many bytes
+  uint64_t synced = 0; // size of the file up to the last synced record
+  string buffer;       // records which are not written yet
+};
+
+/**
+ * @brief Log2 histogram of values (latencies in nanoseconds, batch counts), safe to record and read from any thread.
+ *
+ * Bucket 0 counts zeros, bucket b counts values in [2^(b-1), 2^b). Recording is two relaxed atomic additions, so the
+ * histogram may be read while it is recorded to, a snapshot is then only consistent per bucket.
+ */
+class CHistogram
+{
+public:
+  static const size_t BUCKETS = 48;
+
+  struct CSnapshot
+  {
+    uint64_t buckets[BUCKETS];
+    uint64_t count, sum;
+
+    /** @returns upper bound of the bucket holding the q-quantile (0 <= q <= 1), 0 for an empty histogram */
+    uint64_t quantile(double q) const
+    {
+      uint64_t rank = (uint64_t)(q * count), seen = 0;
+      for (size_t bucket = 0; bucket < BUCKETS; bucket++)
+        if ((seen += buckets[bucket]) > rank || (seen == count && seen != 0))
+          return bucket == 0 ? 0 : (1ULL << bucket) - 1;
+      return 0;
+    }
+  };
+
+  void record(uint64_t value)
+  {
+    size_t bucket = value == 0 ? 0 : min<size_t>(64 - __builtin_clzll(value), BUCKETS - 1);
+    buckets[bucket].fetch_add(1, memory_order_relaxed);
+    sum.fetch_add(value, memory_order_relaxed);
+  }
+
+  CSnapshot snapshot() const
+  {
+    CSnapshot copy;
+    copy.count = 0;
+    for (size_t bucket = 0; bucket < BUCKETS; bucket++)
+      copy.count += copy.buckets[bucket] = buckets[bucket].load(memory_order_relaxed);
+    copy.sum = sum.load(memory_order_relaxed);
+    return copy;
+  }
+
+private:
+  atomic<uint64_t> buckets[BUCKETS] = {};
+  atomic<uint64_t> sum{0};
+};
+
+/**
+ * @brief Process wide counters and histograms of all CSupermarket objects, recorded only when built with DU5_METRICS.
+ *
+ * Without DU5_METRICS the recording macros expand to nothing and the snapshot stays empty, so monitoring code builds
+ * either way. Counters are relaxed atomics, scraping them with snapshot() or exportText() never blocks a store or sell.
+ */
+class CSupermarketMetrics
+{
+public:
+  enum EOperation
+  {
+    STORE,
+    STORE_ALL,
+    SELL,       // a shopping list or a single line item
+    SELL_BATCH, // the batched sell() of many baskets
+    EXPIRED,
+    TYPO,       // one findTypo() lookup
+    PURGE,
+    OPERATIONS
+  };
+
+  struct CSnapshot
+  {
+    CHistogram::CSnapshot latency[OPERATIONS]; // nanoseconds per call
+    CHistogram::CSnapshot batches_per_line;    // batches touched while selling one line item
+    CHistogram::CSnapshot batches_per_expired; // batches summed up by one expired() call
+    uint64_t typo_attempts, typo_hits, typo_ambiguous, typo_candidates, rehashes;
+  };
+
+  static CSupermarketMetrics &global()
+  {
+    static CSupermarketMetrics metrics;
+    return metrics;
+  }
+
+  CSnapshot snapshot() const
+  {
+    CSnapshot copy;
+    for (size_t operation = 0; operation < OPERATIONS; operation++)
+      copy.latency[operation] = latency[operation].snapshot();
+    copy.batches_per_line = batches_per_line.snapshot();
+    copy.batches_per_expired = batches_per_expired.snapshot();
+    copy.typo_attempts = typo_attempts.load(memory_order_relaxed);
+    copy.typo_hits = typo_hits.load(memory_order_relaxed);
+    copy.typo_ambiguous = typo_ambiguous.load(memory_order_relaxed);
+    copy.typo_candidates = typo_candidates.load(memory_order_relaxed);
+    copy.rehashes = rehashes.load(memory_order_relaxed);
+    return copy;
+  }
+
+  /** @brief snapshot in the Prometheus text format, histograms as count, sum and p50/p90/p99 upper bounds */
+  string exportText() const
+  {
+    static const char *const names[OPERATIONS] = {"store", "store_all", "sell", "sell_batch", "expired", "typo",
+                                                         "purge"};
+    CSnapshot copy = snapshot();
+    string text;
+    char line[160];
+    auto histogram = [&](const string &name, const CHistogram::CSnapshot &values)
+    {
+      snprintf(line, sizeof(line), "%s_count %llu\n%s_sum %llu\n", name.c_str(), (unsigned long long)values.count,
+               name.c_str(), (unsigned long long)values.sum);
+      text += line;
+      for (double q : {0.5, 0.9, 0.99})
+      {
+        snprintf(line, sizeof(line), "%s{quantile=\"%g\"} %llu\n", name.c_str(), q,
+                 (unsigned long long)values.quantile(q));
+        text += line;
+      }
+    };
+    for (size_t operation = 0; operation < OPERATIONS; operation++)
+      histogram(string("supermarket_") + names[operation] + "_ns", copy.latency[operation]);
+    histogram("supermarket_batches_per_line", copy.batches_per_line);
+    histogram("supermarket_batches_per_expired", copy.batches_per_expired);
+    snprintf(line, sizeof(line),
+             "supermarket_typo_attempts %llu\nsupermarket_typo_hits %llu\nsupermarket_typo_ambiguous %llu\n"
+             "supermarket_typo_candidates %llu\nsupermarket_rehashes %llu\n",
+             (unsigned long long)copy.typo_attempts, (unsigned long long)copy.typo_hits,
+             (unsigned long long)copy.typo_ambiguous, (unsigned long long)copy.typo_candidates,
+             (unsigned long long)copy.rehashes);
+    return text + line;
+  }
+
+  /** @brief records the time from its construction to its destruction into a latency histogram */
+  class CScopedTimer
+  {
+  public:
+    explicit CScopedTimer(EOperation operation) : operation(operation), start(chrono::steady_clock::now()) {}
+    ~CScopedTimer()
+    {
+      global().latency[operation].record(
+          chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+    }
+
+  private:
+    EOperation operation;
+    chrono::steady_clock::time_point start;
+  };
+
+  CHistogram latency[OPERATIONS];
+  CHistogram batches_per_line, batches_per_expired;
+  atomic<uint64_t> typo_attempts{0}, typo_hits{0}, typo_ambiguous{0};
+  atomic<uint64_t> typo_candidates{0}; // names compared letter by letter by findTypo()
+  atomic<uint64_t> rehashes{0};        // growths of name_pool or typo_index, each of them rehashes all entries
+};
+
+#ifdef DU5_METRICS
+#define DU5_TIMED(operation) CSupermarketMetrics::CScopedTimer scoped_timer(CSupermarketMetrics::operation)
+#define DU5_COUNT(counter, value) CSupermarketMetrics::global().counter.fetch_add(value, memory_order_relaxed)
+#define DU5_RECORD(histogram, value) CSupermarketMetrics::global().histogram.record(value)
+#else
+#define DU5_TIMED(operation)
+#define DU5_COUNT(counter, value) ((void)(value))
+#define DU5_RECORD(histogram, value) ((void)(value))
+#endif /* DU5_METRICS */
+
+/**
+ * @brief Worker threads shared by the parallel expired() reports of all CSupermarket objects.
+ *
+ * The threads are started by the first report which needs them (the pool grows to the most threads ever asked for)
+ * and then sleep between runs, so the sum phase and every merge round wake threads up instead of creating and joining
+ * them. run() hands the tasks out one by one through an atomic counter and the calling thread works too. One run() is
+ * executed at a time, concurrent callers wait for the previous one, so a task must not call run() itself.
+ */
+class CWorkerPool
+{
+public:
+  static CWorkerPool &global()
+  {
+    static CWorkerPool pool;
+    return pool;
+  }
+  ~CWorkerPool()
+  {
+    {
+      lock_guard<mutex> guard(lock);
+      stopping = true;
+    }
+    wake.notify_all();
+    for (auto &worker : workers)
+      worker.join();
+  }
+
+  /** @brief calls task(0) ... task(tasks - 1) from threads threads, the calling one included, and waits for them */
+  void run(unsigned threads, size_t tasks, const function<void(size_t)> &task)
+  {
+    size_t helpers = min<size_t>(max(threads, 1u), tasks) - (tasks != 0);
+    if (helpers == 0)
+    {
+      for (size_t current = 0; current < tasks; current++)
+        task(current);
+      return;
+    }
+    lock_guard<mutex> run_guard(run_lock);
+    {
+      lock_guard<mutex> guard(lock);
+      while (workers.size() < helpers) // a new thread waits for the next generation, this one
+        workers.emplace_back(&CWorkerPool::serve, this, generation);
+      job = &task;
+      task_count = tasks;
+      next_task = 0;
+      wanted = active = helpers;
+      generation++;
+    }
+    wake.notify_all();
+    work();
+    unique_lock<mutex> guard(lock);
+    done.wait(guard, [this]()
+              { return active == 0; });
+    job = nullptr;
+  }
+
+private:
+  CWorkerPool() = default;
+
+  void serve(uint64_t seen)
+  {
+    unique_lock<mutex> guard(lock);
+    while (true)
+    {
+      wake.wait(guard, [this, seen]()
+                { return stopping || generation != seen; });
+      if (stopping)
+        return;
+      seen = generation;
+      if (wanted == 0) // enough threads joined this run
+        continue;
+      wanted--;
+      guard.unlock();
+      work();
+      guard.lock();
+      if (--active == 0)
+        done.notify_all();
+    }
+  }
+
+  void work()
+  {
+    for (size_t current = next_task++; current < task_count; current = next_task++)
+      (*job)(current);
+  }
+
+  mutex run_lock;          // one run() at a time
+  mutex lock;              // guards everything below but next_task
+  condition_variable wake; // a new run or stopping
+  condition_variable done; // active dropped to zero
+  vector<thread> workers;
+  const function<void(size_t)> *job = nullptr;
+  size_t task_count = 0;
+  atomic<size_t> next_task{0};
+  size_t wanted = 0, active = 0; // threads which still have to join the run / to finish it
+  uint64_t generation = 0;
+  bool stopping = false;
+};
+
+/**
+ * Main class which implements storing, selling and finding expired products. Product names are interned in name_pool,
+ * which maps them to compact ids, and product_list keeps a sorted list of batches for every id. This allows to have
+ * constant time complexity for all basic operations and lets callers look products up by string_view without
+ * allocating. Our class doesn`t have a destructor, as a default would be enough. As you can notice, in private members
+ * we have a struct CProduct, which is responsible for a better storage of product variables(expiry date and count in
+ * our case), struct set_cmp, which is basically a comparator of batches by date, and class CBatchList, which keeps the
+ * batches of one product ordered by date.
+ */
+class CSupermarket
+{
+
+public:
+  /** @brief one line of an inventory feed, see storeAll(). The name is taken by value so it can be moved in */
+  struct CStoreRecord
+  {
+    string name;
+    CDate expiry_date;
+    int count;
+  };
+
+  /** @brief one line item of a shopping list for the span based sell(), the name is not owned */
+  struct CLineItem
+  {
+    string_view name;
+    int count;
+  };
+
+  /** @brief one shopping list of a batched sell(), the line items are not owned */
+  struct CBasket
+  {
+    const CLineItem *items;
+    size_t item_count;
+  };
+
+  /**
+   * @brief Reusable result of the span based sell() and expired().
+   *
+   * Every entry is a name, a count and a line. For sell() the line is the index of the unsold line item in the
+   * shopping list and the name is the real name of the product (corrected when it contained a spelling mistake). For
+   * expired() the lines are just consecutive numbers. Names are copied into one shared buffer, clear() keeps the
+   * capacity of both vectors, so a buffer which is reused for every checkout stops allocating after a few calls.
+   */
+  class CResultBuffer
+  {
+  public:
+    size_t size() const { return entries.size(); }
+    bool empty() const { return entries.empty(); }
+    string_view name(size_t index) const
+    {
+      return string_view(names.data() + entries[index].name_offset, entries[index].name_length);
+    }
+    int count(size_t index) const { return entries[index].count; }
+    size_t line(size_t index) const { return entries[index].line; }
+    void clear()
+    {
+      entries.clear();
+      names.clear();
+    }
+
+  private:
+    friend class CSupermarket;
+
+    struct CEntry
+    {
+      size_t line;
+      size_t name_offset, name_length;
+      int count;
+    };
+
+    void add(string_view name, int count, size_t line)
+    {
+      entries.push_back(CEntry{line, names.size(), name.size(), count});
+      names.append(name);
+    }
+
+    /** @brief sorts the entries by count in descending order, entries with the same count keep their line order */
+    void sortByCount()
+    {
+      sort(entries.begin(), entries.end(), [](const CEntry &x, const CEntry &y)
+           { return x.count != y.count ? y.count < x.count : x.line < y.line; });
+    }
+
+    vector<CEntry> entries;
+    string names;
+  };
+
+  // initializing constructor for our containers.
+  CSupermarket() : name_pool(), product_list(), expiry_index(){};
+  CSupermarket &store(string_view name, const CDate &expiry_date, int count);
+  CSupermarket &storeAll(vector<CStoreRecord> records);
+  friend bool getRealName(CSupermarket &obj, string &product_validate);
+  list<pair<string, int>> sell(list<pair<string, int>> &shoppingList);
+  int sell(string_view name, int count);
+  void sell(const CLineItem *items, size_t item_count, CResultBuffer &unsold);
+  void sell(const CBasket *baskets, size_t basket_count, vector<CResultBuffer> &unsold);
+  list<pair<string, int>> expired(const CDate &date) const;
+  list<pair<string, int>> expired(const CDate &from, const CDate &to) const;
+  void expired(const CDate &date, CResultBuffer &result) const;
+  void expired(const CDate &from, const CDate &to, CResultBuffer &result) const;
+  list<pair<string, int>> expiredSinceLastCall(const CDate &date);
+  list<pair<string, int>> expired(const CDate &date, unsigned threads) const;
+  list<pair<string, int>> expiredTop(const CDate &date, size_t top, unsigned threads = 1) const;
+  list<pair<string, int>> purge(const CDate &today, int grace_days = 0);
+  bool openLog(const string &path, size_t group_bytes = 1 << 16);
+  bool syncLog();
+  bool saveSnapshot(const string &path);
+  bool recover(const string &snapshot_path, const string &log_path);
+  friend class CConcurrentSupermarket;
+
+private:
+  /** @brief struct for convenient storage of the date and product count. Used in CBatchList in product_list */
+  struct CProduct
+  {
+    CDate expire_date;
+    int product_count;
+  };
+
+  /** @brief struct for custom batch comparator. Compares two dates */
+  struct set_cmp // code from stack_overflow for a custom set comparator
+  {
+    bool operator()(const CProduct &a, const CProduct &b) const
+    {
+      return a.expire_date < b.expire_date;
+    }
+  };
+
+  /**
+   * @brief Batches of one product ordered by expiry date.
+   *
+   * Most products have only a handful of live batches, so instead of a set (one heap node per batch) the batches live
+   * in a flat sorted array. The first INLINE_CAPACITY batches are stored directly inside the object, longer lists move to
+   * the heap. sell() consumes batches from the front, which only moves the head index, the consumed slots are reused
+   * once the array gets full. store() finds the date by binary search and merges batches with the same date.
+   */
+  class CBatchList
+  {
+  public:
+    static const uint32_t INLINE_CAPACITY = 4;
+
+    CBatchList() : head(0), tail(0), capacity(INLINE_CAPACITY){};
+    CBatchList(const CBatchList &src) : CBatchList()
+    {
+      for (const CProduct &batch : src)
+        insert(batch);
+    }
+    CBatchList(CBatchList &&src) noexcept : CBatchList()
+    {
+      swap(src);
+    }
+    CBatchList &operator=(CBatchList src) noexcept
+    {
+      swap(src);
+      return *this;
+    }
+    ~CBatchList()
+    {
+      if (capacity > INLINE_CAPACITY)
+        ::operator delete(storage.heap);
+    }
+
+    size_t size() const { return tail - head; }
+    bool empty() const { return head == tail; }
+    CProduct *begin() { return data() + head; }
+    CProduct *end() { return data() + tail; }
+    const CProduct *begin() const { return data() + head; }
+    const CProduct *end() const { return data() + tail; }
+    CProduct &front() { return data()[head]; }
+
+    /** @brief removes the oldest batch, O(1) */
+    void popFront()
+    {
+      if (++head == tail)
+        head = tail = 0;
+    }
+
+    /** @brief returns the batch with the given date or nullptr, O(log n) */
+    const CProduct *find(const CDate &date) const
+    {
+      const CProduct *batch = lower_bound(begin(), end(), CProduct{date, 0}, set_cmp());
+      return batch != end() && batch->expire_date == date ? batch : nullptr;
+    }
+    CProduct *find(const CDate &date)
+    {
+      return const_cast<CProduct *>(static_cast<const CBatchList *>(this)->find(date));
+    }
+
+    /**
+     * @brief Inserts the batch at its position, or adds its count to the batch with the same date.
+     * @returns true if a new batch was created, false if it was merged
+     */
+    bool insert(const CProduct &batch)
+    {
+      CProduct *position = lower_bound(begin(), end(), batch, set_cmp());
+      if (position != end() && position->expire_date == batch.expire_date)
+      {
+        position->product_count += batch.product_count;
+        return false;
+      }
+      size_t offset = position - begin();
+      if (tail == capacity)
+        reserve(size() + 1);
+      position = begin() + offset;
+      memmove(position + 1, position, (end() - position) * sizeof(CProduct));
+      *position = batch;
+      tail++;
+      return true;
+    }
+
+    /**
+     * @brief Merges sorted batches whose dates are not in the list yet, O(n + k).
+     *
+     * The array grows at most once and the batches are merged from the back, so existing batches move only once.
+     */
+    void mergeSorted(const CProduct *first, const CProduct *last)
+    {
+      size_t added = last - first;
+      if (tail + added > capacity)
+        reserve(size() + added);
+      CProduct *merged = end() + added, *own = end();
+      while (first != last)
+      {
+        if (own != begin() && set_cmp()(last[-1], own[-1]))
+          *--merged = *--own;
+        else
+          *--merged = *--last;
+      }
+      tail += added;
+    }
+
+    /** @brief moves a grown list which is mostly consumed back to a smaller array, or inline. O(n) */
+    void shrinkToFit()
+    {
+      if (capacity <= INLINE_CAPACITY || size() * 4 > capacity)
+        return;
+      CBatchList compact;
+      compact.mergeSorted(begin(), end());
+      swap(compact);
+    }
+
+    void swap(CBatchList &other)
+    {
+      std::swap(head, other.head);
+      std::swap(tail, other.tail);
+      std::swap(capacity, other.capacity);
+      std::swap(storage, other.storage);
+    }
+
+  private:
+    static_assert(is_trivially_copyable<CProduct>::value, "batches are moved with memmove");
+
+    CProduct *data() { return capacity > INLINE_CAPACITY ? storage.heap : reinterpret_cast<CProduct *>(storage.local); }
+    const CProduct *data() const
+    {
+      return capacity > INLINE_CAPACITY ? storage.heap : reinterpret_cast<const CProduct *>(storage.local);
+    }
+
+    /** @brief makes room for at least the given number of batches, moves live batches to the beginning */
+    void reserve(size_t needed)
+    {
+      if (needed <= capacity) // consumed slots at the front are enough
+      {
+        memmove(data(), begin(), size() * sizeof(CProduct));
+        tail -= head;
+        head = 0;
+        return;
+      }
+      uint32_t new_capacity = max<uint32_t>(capacity * 2, needed);
+      CProduct *grown = static_cast<CProduct *>(::operator new(new_capacity * sizeof(CProduct)));
+      memcpy(grown, begin(), size() * sizeof(CProduct));
+      if (capacity > INLINE_CAPACITY)
+        ::operator delete(storage.heap);
+      tail -= head;
+      head = 0;
+      capacity = new_capacity;
+      storage.heap = grown;
+    }
+
+    uint32_t head, tail, capacity;
+    union
+    {
+      CProduct *heap;
+      alignas(CProduct) unsigned char local[INLINE_CAPACITY * sizeof(CProduct)];
+    } storage;
+  };
+
+  /**
+   * @brief Registers a freshly stored product name in typo_index.
+   *
+   * For every letter position we insert the product into the bucket of its wildcard signature, which is the name with
+   * that letter replaced by '?' (for example "coke" goes to "?oke", "c?ke", "co?e" and "cok?"). Two names of equal
+   * length that differ in exactly one letter always share exactly one signature, so getRealName() only has to look at
+   * the buckets of its own signatures instead of the whole product_list. Buckets are keyed by a polynomial hash of the
+   * signature, which is updated in O(1) per letter, so no signature string is ever built.
+   */
+  void indexName(uint32_t product);
+  /** @brief Removes the product from every bucket of typo_index. Called right before the product is erased. */
+  void unindexName(uint32_t product);
+  /**
+   * @param[out] product id of the product which differs from the name in exactly one letter, valid if 1 is returned
+   * @returns number of such products, 0, 1 or 2 for two and more
+   */
+  int findTypo(string_view name, uint32_t &product) const;
+  static uint64_t nameHash(string_view name);
+  static const uint64_t HASH_BASE = 0x100000001b3ULL;
+
+  /** @brief interns a new name and prepares its (empty) batches. @returns id of the new product */
+  uint32_t addProduct(string &&name);
+  /** @brief removes a sold out product from all structures, its id may be reused afterwards */
+  void eraseProduct(uint32_t product);
+  /**
+   * @brief Sells one line item from the oldest batches of the product.
+   * @param[in,out] count items to sell, decreased by the number of items sold from fully sold out batches
+   * @param[out] sold_out set if the last batch of the product was sold by this call
+   * @returns true if the line item was sold completely, otherwise false
+   */
+  bool sellBatches(uint32_t product, int &count, bool &sold_out);
+
+  /**
+   * @brief Position of a batched sell() in the batches of one product.
+   *
+   * The batches in front of `batch` are sold out and `taken` items of `batch` are sold, but CBatchList and expiry_index
+   * are updated only by commitCursor(), so the batches are walked once however many line items take from them.
+   */
+  struct CSellCursor
+  {
+    uint32_t batch = 0;
+    int taken = 0;
+    bool touched = false;
+    bool erased = false; // sold out and erased by the running call
+  };
+  /**
+   * @brief Sells one line item from the cursor of the product, see sellBatches()
+   * @param[out] sold_out set if the last batch of the product was sold by this call
+   */
+  bool sellFromCursor(uint32_t product, int &count, bool &sold_out);
+  /** @brief applies the cursor of the product to its batches and expiry_index, the cursor starts at the front again */
+  void commitCursor(uint32_t product);
+
+  /** @brief entry of expiry_index, one per stored batch */
+  struct CExpiryEntry
+  {
+    CDate expire_date;
+    uint32_t product;
+  };
+
+  /** @brief orders expiry_index by date, batches of the same date are ordered by their product */
+  struct expiry_cmp
+  {
+    bool operator()(const CExpiryEntry &a, const CExpiryEntry &b) const
+    {
+      if (!(a.expire_date == b.expire_date))
+        return a.expire_date < b.expire_date;
+      return a.product < b.product;
+    }
+  };
+
+  /** @brief sums up batches of expiry_index in [first, last) per product and sorts the result by count */
+  list<pair<string, int>> collectExpired(set<CExpiryEntry, expiry_cmp>::const_iterator first,
+                                         set<CExpiryEntry, expiry_cmp>::const_iterator last) const;
+
+  /**
+   * @brief Calls report(product, expired items) for every product with a batch in [first, last) of expiry_index.
+   *
+   * Batches of a product are sorted by date, so its batches in the range are a continuous run of its CBatchList. The
+   * run is summed up when we meet its first batch in the index, the other batches of the run are skipped. No hash map
+   * is needed to group the batches and the time is O(k log b) for k batches in the range. Running totals per product
+   * are not kept: a cutoff usually falls between the batches of a product, where a total does not help, and the index
+   * visits the k batches anyway, so summing the run costs no more than looking a total up.
+   */
+  template <typename F_>
+  void sumExpired(set<CExpiryEntry, expiry_cmp>::const_iterator first,
+                  set<CExpiryEntry, expiry_cmp>::const_iterator last, F_ report) const
+  {
+    if (first == last)
+    {
+      DU5_RECORD(batches_per_expired, 0);
+      return;
+    }
+    uint64_t scanned = 0;
+    const CDate from = first->expire_date; // the index has no batches in [cutoff, from), so `from` bounds every run
+    const CDate to = last == expiry_index.end() ? CDate(0, 1, 1) : last->expire_date;
+    for (; first != last; ++first) // iterating through expired batches only
+    {
+      const CBatchList &batches = product_list[first->product];
+      const CProduct *batch = lower_bound(batches.begin(), batches.end(), CProduct{from, 0}, set_cmp());
+      if (!(batch->expire_date == first->expire_date)) // not the first batch of the run, already counted
+        continue;
+      int sum = 0;
+      for (; batch != batches.end() && (last == expiry_index.end() || batch->expire_date < to); ++batch, ++scanned)
+        sum += batch->product_count;
+      if (sum != 0)
+        report(first->product, sum);
+    }
+    DU5_RECORD(batches_per_expired, scanned);
+  }
+
+  /**
+   * @brief Parallel counterpart of sumExpired(), aggregates the products in chunks of ids on CWorkerPool::global().
+   *
+   * Every chunk is sorted by count (or only its best `top` entries are selected) by the worker which summed it, the
+   * sorted chunks are then merged pairwise, every merge round runs on the same pool threads.
+   *
+   * @param[in] top number of entries to keep, SIZE_MAX keeps all of them
+   * @returns (product, expired items) sorted by count in descending order
+   */
+  vector<pair<uint32_t, int>> sumExpiredParallel(const CDate &date, size_t top, unsigned threads) const;
+  /** @brief creates the result list of expired() from (product, expired items) pairs, keeps their order */
+  list<pair<string, int>> namedList(const vector<pair<uint32_t, int>> &sums) const;
+  /** @brief calls task(0) ... task(tasks - 1) from the given number of threads of CWorkerPool::global() */
+  static void runParallel(unsigned threads, size_t tasks, const function<void(size_t)> &task);
+
+  /** @brief first part of a snapshot, see saveSnapshot() */
+  struct CSnapshotHeader
+  {
+    char magic[8];
+    uint32_t version;
+    uint32_t slots;      // ids of name_pool, released ones included
+    uint32_t free_ids;   // released ids
+    uint32_t batches;    // batches of all products
+    uint64_t name_bytes; // length of all names
+    uint64_t log_offset; // size of the operation log when the snapshot was taken
+    int32_t last_cutoff; // day number of last_cutoff
+    uint32_t sweep_started;
+    uint64_t checksum; // of everything behind the header
+  };
+  static const uint32_t SNAPSHOT_VERSION = 1;
+  static uint64_t snapshotChecksum(const char *data, size_t length);
+  static int dayNumber(const CDate &date) { return date - CDate(1970, 1, 1); }
+  /** @brief replaces the contents by the snapshot. @returns false if it can not be read or is not valid */
+  bool loadSnapshot(const string &path, uint64_t &log_offset);
+  /** @brief repeats one record of the operation log. @returns false if it does not fit the current state */
+  bool applyLogRecord(COperationLog::EOperation operation, string_view name, int day, int count);
+
+  CNamePool name_pool;
+  /** @brief id of the product -> its batches. Slots of released ids are empty */
+  vector<CBatchList> product_list;
+  /** @brief every batch of product_list ordered by expiry date, lets expired() stop at the first fresh batch */
+  set<CExpiryEntry, expiry_cmp> expiry_index;
+  /** @brief cutoff of the previous expiredSinceLastCall(), valid only if sweep_started is set */
+  CDate last_cutoff = CDate(1970, 1, 1);
+  bool sweep_started = false;
+  /** @brief products sold out by the running sell(), kept as a member to reuse its memory */
+  vector<uint32_t> sold_out_products;
+  /** @brief product id -> its cursor in the running batched sell(), all of them are reset between calls */
+  vector<CSellCursor> sell_cursors;
+  /** @brief products with a touched cursor in the running batched sell() */
+  vector<uint32_t> touched_products;
+  /** @brief product id -> 1 + its group in the running storeAll(), 0 outside of it */
+  vector<uint32_t> ingest_groups;
+  /** @brief hash of a wildcard signature -> ids of products producing it */
+  unordered_multimap<uint64_t, uint32_t> typo_index;
+  /** @brief effects of store() and sell() are appended here once openLog() is called */
+  COperationLog operation_log;
+};
+
+/** @brief comparator function for pairs based on second value. Used for sorting pairs in function "expiry" */
+bool pairComparator(const pair<string, int> &x, const pair<string, int> &y)
+{
+  return (y.second < x.second);
+}
+/**
+ * @brief Helper function for finding products with one mistake in the spelling.
+ * @param[in] obj gaining access to private members.
+ * @param[in,out] product_validate product name to find and change if we found only one matching word
+ *
+ * In this method we receive name of the product we want to potentially find in our product_list. The search itself is
+ * done by CSupermarket::findTypo(). If ONLY one word with single mistake was found, we make our product_validate equal
+ * to the name of the found product, otherwise we return false.
+ *
+ * @returns true if only one name with one mistake was found, otherwise returns false.
+ */
+bool getRealName(CSupermarket &obj, string &product_validate)
+{
+  uint32_t found_product;
+  if (obj.findTypo(product_validate, found_product) == 1) // found the word to return
+  {
+    product_validate = obj.name_pool.name(found_product);
+    return true;
+  }
+  else
+    return false;
+}
+
+/**
+ * @brief Finds the product which differs from the name in exactly one letter.
+ *
+ * Time complexity of this function is O(L) on average, where L is the length of the name. Instead of scanning the whole
+ * product_list we compute the hash of every wildcard signature of the name (one letter replaced by '?') and look it up
+ * in typo_index. Every product which differs from the name in exactly one letter is stored in one of these buckets.
+ * Candidates are still compared letter by letter, as a hash collision or a name containing a real '?' may land in a
+ * bucket it does not belong to.
+ */
+int CSupermarket::findTypo(string_view name, uint32_t &found_product) const
+{
+  DU5_TIMED(TYPO);
+  DU5_COUNT(typo_attempts, 1);
+  int correct_words_cnt = 0; // count of words found with a single mistake
+  uint64_t candidates = 0;   // names of the same length compared letter by letter
+  uint64_t full_hash = nameHash(name), power = 1;
+  for (size_t letter = 0; letter < name.size(); letter++, power *= HASH_BASE) // iterating through wildcard signatures
+  {
+    uint64_t signature = full_hash + ((uint64_t)'?' - (unsigned char)name[letter]) * power;
+    auto bucket = typo_index.equal_range(signature);
+    for (auto entry = bucket.first; entry != bucket.second; ++entry)
+    {
+      const string &candidate = name_pool.name(entry->second);
+      if (candidate.size() != name.size())
+        continue;
+      candidates++;
+      int mistake_counter = 0;
+      for (size_t pos = 0; pos < candidate.size() && mistake_counter <= 1; pos++)
+        if (candidate[pos] != name[pos])
+          mistake_counter++;
+
+      if (mistake_counter != 1 || (correct_words_cnt == 1 && entry->second == found_product))
+        continue;
+      if (++correct_words_cnt > 1) // second word with one mistake, name is ambiguous
+      {
+        DU5_COUNT(typo_ambiguous, 1);
+        DU5_COUNT(typo_candidates, candidates);
+        return correct_words_cnt;
+      }
+      found_product = entry->second;
+    }
+  }
+  DU5_COUNT(typo_hits, correct_words_cnt);
+  DU5_COUNT(typo_candidates, candidates);
+  return correct_words_cnt;
+}
+
+/** @brief polynomial hash of the name, sum of name[i] * HASH_BASE^i modulo 2^64 */
+uint64_t CSupermarket::nameHash(string_view name)
+{
+  uint64_t hash = 0, power = 1;
+  for (char letter : name)
+  {
+    hash += (unsigned char)letter * power;
+    power *= HASH_BASE;
+  }
+  return hash;
+}
+
+void CSupermarket::indexName(uint32_t product)
+{
+  const string &name = name_pool.name(product);
+  uint64_t full_hash = nameHash(name), power = 1;
+  for (size_t letter = 0; letter < name.size(); letter++, power *= HASH_BASE)
+    typo_index.emplace(full_hash + ((uint64_t)'?' - (unsigned char)name[letter]) * power, product);
+}
+
+void CSupermarket::unindexName(uint32_t product)
+{
+  const string &name = name_pool.name(product);
+  uint64_t full_hash = nameHash(name), power = 1;
+  for (size_t letter = 0; letter < name.size(); letter++, power *= HASH_BASE)
+  {
+    auto bucket = typo_index.equal_range(full_hash + ((uint64_t)'?' - (unsigned char)name[letter]) * power);
+    for (auto entry = bucket.first; entry != bucket.second; ++entry)
+      if (entry->second == product)
+      {
+        typo_index.erase(entry);
+        break;
+      }
+  }
+}
+
+uint32_t CSupermarket::addProduct(string &&name)
+{
+  size_t typo_buckets = typo_index.bucket_count(), name_slots = name_pool.buckets();
+  uint32_t product = name_pool.add(move(name));
+  if (product == product_list.size())
+    product_list.emplace_back();
+  indexName(product);
+  DU5_COUNT(rehashes, (typo_buckets != typo_index.bucket_count()) + (name_slots != name_pool.buckets()));
+  return product;
+}
+
+void CSupermarket::eraseProduct(uint32_t product)
+{
+  operation_log.append(COperationLog::ERASE, name_pool.name(product), 0, 0);
+  unindexName(product);
+  name_pool.release(product);
+  product_list[product] = CBatchList(); // releasing memory of a grown list
+}
+
+bool CSupermarket::sellBatches(uint32_t product, int &count, bool &sold_out)
+{
+  CBatchList &batches = product_list[product];
+  bool batch_sold = false;
+  bool line_sold = false;
+  uint64_t touched = 0;
+
+  while (!batches.empty()) // iterating through batches from the oldest one
+  {
+    CProduct &oldest = batches.front();
+    touched++;
+    if (oldest.product_count < count)
+    {
+      count = count - oldest.product_count;
+      operation_log.append(COperationLog::POP, name_pool.name(product), dayNumber(oldest.expire_date), 0);
+      expiry_index.erase(CExpiryEntry{oldest.expire_date, product});
+      batches.popFront();
+      batch_sold = true;
+      continue; // intentional continue
+    }
+    else if (oldest.product_count == count)
+    {
+      line_sold = true;
+      operation_log.append(COperationLog::POP, name_pool.name(product), dayNumber(oldest.expire_date), 0);
+      expiry_index.erase(CExpiryEntry{oldest.expire_date, product});
+      batches.popFront();
+      batch_sold = true;
+      break; // intentional break to iterate through shopping list
+    }
+    else
+    {
+      operation_log.append(COperationLog::TAKE, name_pool.name(product), dayNumber(oldest.expire_date), count);
+      oldest.product_count = oldest.product_count - count;
+      line_sold = true;
+      break; // intentional break to iterate through shopping list
+    }
+  }
+  sold_out = batch_sold && batches.empty();
+  DU5_RECORD(batches_per_line, touched);
+  return line_sold;
+}
+
+/**
+ * @brief Sells products listed in the shopping list
+ *
+ * @param[in,out] shoppingList list of all products we have to sell
+ *
+ *  Thin wrapper around the span based sell(). The line items are passed as views into the list, the list is then
+ *  updated from the result: sold line items are erased, the rest gets the unsold count and the corrected name.
+ *
+ * @returns shoppingList without sold products
+ */
+list<pair<string, int>> CSupermarket::sell(list<pair<string, int>> &shoppingList)
+{
+  vector<CLineItem> items;
+  items.reserve(shoppingList.size());
+  for (auto const &product_buy : shoppingList)
+    items.push_back(CLineItem{product_buy.first, product_buy.second});
+  CResultBuffer unsold;
+  sell(items.data(), items.size(), unsold);
+
+  size_t line = 0, next_unsold = 0;
+  for (auto product_buy = shoppingList.begin(); product_buy != shoppingList.end(); line++) // iterating through shopping list
+  {
+    if (next_unsold < unsold.size() && unsold.line(next_unsold) == line)
+    {
+      if (product_buy->first != unsold.name(next_unsold))
+        product_buy->first = unsold.name(next_unsold);
+      product_buy->second = unsold.count(next_unsold++);
+      ++product_buy;
+    }
+    else
+      product_buy = shoppingList.erase(product_buy); // clearing memory allocated for sold products
+  }
+  return shoppingList;
+}
+
+/**
+ * @brief Sells line items of a shopping list without copying it.
+ *
+ * @param[in] items line items, names are only read during the call
+ * @param[in] item_count number of line items
+ * @param[out] unsold cleared and filled with the line items which were not sold completely, in their order
+ *
+ *  Firstly, we check if product to sell is present in our name_pool, this operation takes O(L) (L being the length of
+ *  the name) as we should account for a mistake in spelling of a product`s name. If we found the product, we consume
+ *  its batches beginning from the oldest(with lowest expiry date). A fully sold batch is just popped from the front of
+ *  its CBatchList, which is O(1). Secondly, we should check whether we have sold all batches of the product, in this
+ *  case we delete the whole product. Products are deleted after the whole shopping list, so a later line item still
+ *  finds them. Once unsold and sold_out_products have grown enough, a call does not allocate unless a product gets
+ *  sold out.
+ */
+void CSupermarket::sell(const CLineItem *items, size_t item_count, CResultBuffer &unsold)
+{
+  DU5_TIMED(SELL);
+  unsold.clear();
+  sold_out_products.clear();
+  for (size_t line = 0; line < item_count; line++) // iterating through shopping list
+  {
+    string_view name = items[line].name;
+    int count = items[line].count;
+    uint32_t product = name_pool.find(name), real_product;
+    if (product == CNamePool::NOT_FOUND && findTypo(name, real_product) == 1) // checking for a spelling mistake
+    {
+      product = real_product;
+      name = name_pool.name(product);
+    }
+    if (product == CNamePool::NOT_FOUND)
+    {
+      unsold.add(name, count, line);
+      continue;
+    }
+
+    bool sold_out;
+    if (!sellBatches(product, count, sold_out))
+      unsold.add(name, count, line);
+    if (sold_out) // if product is empty - add it to the "cleaning" vector
+      sold_out_products.push_back(product);
+  }
+  for (auto product : sold_out_products) // clearing memory allocated for sold out products
+    eraseProduct(product);
+}
+
+/**
+ * @brief Sells many shopping lists at once, for example all checkouts which arrived since the previous call.
+ *
+ * @param[in] baskets shopping lists in their arrival order, which is their priority for the stock
+ * @param[in] basket_count number of shopping lists
+ * @param[out] unsold resized to basket_count, unsold[i] is filled like the result of sell(items, item_count, unsold)
+ *             for the i-th shopping list. Reusing the vector reuses the buffers
+ *
+ *  The result is the same as selling the baskets one by one in their order, including products sold out by a basket
+ *  being erased before the next one. The difference is in the work done per line item:
+ *  - Every distinct misspelled name is resolved once. A resolution only changes when a product is erased, so a cached
+ *    one is resolved again only if it points to an erased product, or if it was ambiguous and a product was erased
+ *    since. Names without a match stay without it, as selling never adds products. Exact names cost one lookup in
+ *    name_pool like in sell(), caching them would only add a second hash.
+ *  - Line items do not change the batches, they move the CSellCursor of their product. Each touched product is then
+ *    committed once, when it gets sold out or after the last basket, so the batches of a product and its entries of
+ *    expiry_index are walked once per call however many baskets contain it.
+ */
+void CSupermarket::sell(const CBasket *baskets, size_t basket_count, vector<CResultBuffer> &unsold)
+{
+  DU5_TIMED(SELL_BATCH);
+  struct CResolution
+  {
+    uint32_t product = CNamePool::NOT_FOUND; // NOT_FOUND if the name is unknown or ambiguous
+    bool ambiguous = false;                  // more products differ from the name in one letter
+    size_t generation = 0;                   // number of baskets which erased a product before the resolution
+  };
+  size_t generation = 0;
+  unordered_map<string_view, CResolution> misspelled; // names which are not in name_pool -> their resolution
+  unsold.resize(basket_count);
+  if (sell_cursors.size() < product_list.size())
+    sell_cursors.resize(product_list.size());
+  touched_products.clear();
+
+  for (size_t basket = 0; basket < basket_count; basket++) // baskets in their arrival order
+  {
+    unsold[basket].clear();
+    sold_out_products.clear();
+    for (size_t line = 0; line < baskets[basket].item_count; line++) // iterating through shopping list
+    {
+      const CLineItem &item = baskets[basket].items[line];
+      uint32_t product = name_pool.find(item.name);
+      if (product == CNamePool::NOT_FOUND) // checking for a spelling mistake
+      {
+        auto cached = misspelled.try_emplace(item.name);
+        CResolution &resolution = cached.first->second;
+        if (cached.second || (resolution.product != CNamePool::NOT_FOUND && sell_cursors[resolution.product].erased) ||
+            (resolution.ambiguous && resolution.generation != generation))
+        {
+          uint32_t real_product;
+          int found = findTypo(item.name, real_product);
+          resolution = CResolution{found == 1 ? real_product : CNamePool::NOT_FOUND, found > 1, generation};
+        }
+        product = resolution.product;
+      }
+      int count = item.count;
+      if (product == CNamePool::NOT_FOUND)
+      {
+        unsold[basket].add(item.name, count, line);
+        continue;
+      }
+
+      bool sold_out;
+      if (!sellFromCursor(product, count, sold_out))
+        unsold[basket].add(name_pool.name(product), count, line);
+      if (sold_out) // if product is empty - add it to the "cleaning" vector
+        sold_out_products.push_back(product);
+    }
+    if (sold_out_products.empty())
+      continue;
+    for (auto product : sold_out_products) // clearing memory allocated for sold out products
+    {
+      commitCursor(product);
+      eraseProduct(product);
+      sell_cursors[product].erased = true;
+    }
+    generation++;
+  }
+  for (auto product : touched_products) // committing products which were not sold out, resetting all cursors
+  {
+    if (!sell_cursors[product].erased)
+      commitCursor(product);
+    sell_cursors[product] = CSellCursor();
+  }
+  touched_products.clear();
+}
+
+bool CSupermarket::sellFromCursor(uint32_t product, int &count, bool &sold_out)
+{
+  const CBatchList &batches = product_list[product];
+  CSellCursor &cursor = sell_cursors[product];
+  if (!cursor.touched)
+  {
+    cursor.touched = true;
+    touched_products.push_back(product);
+  }
+  bool batch_sold = false;
+  bool line_sold = false;
+  uint32_t first_batch = cursor.batch;
+
+  while (cursor.batch < batches.size()) // the same decisions as in sellBatches(), only on the cursor
+  {
+    int left = batches.begin()[cursor.batch].product_count - cursor.taken;
+    if (left < count)
+    {
+      count = count - left;
+      cursor.batch++;
+      cursor.taken = 0;
+      batch_sold = true;
+      continue;
+    }
+    else if (left == count)
+    {
+      line_sold = true;
+      cursor.batch++;
+      cursor.taken = 0;
+      batch_sold = true;
+      break;
+    }
+    else
+    {
+      cursor.taken += count;
+      line_sold = true;
+      break;
+    }
+  }
+  sold_out = batch_sold && cursor.batch == batches.size();
+  DU5_RECORD(batches_per_line, cursor.batch - first_batch + (cursor.taken != 0 && line_sold));
+  return line_sold;
+}
+
+void CSupermarket::commitCursor(uint32_t product)
+{
+  CBatchList &batches = product_list[product];
+  CSellCursor &cursor = sell_cursors[product];
+  for (; cursor.batch > 0; cursor.batch--)
+  {
+    operation_log.append(COperationLog::POP, name_pool.name(product), dayNumber(batches.front().expire_date), 0);
+    expiry_index.erase(CExpiryEntry{batches.front().expire_date, product});
+    batches.popFront();
+  }
+  if (cursor.taken != 0)
+  {
+    operation_log.append(COperationLog::TAKE, name_pool.name(product), dayNumber(batches.front().expire_date),
+                         cursor.taken);
+    batches.front().product_count -= cursor.taken;
+  }
+  cursor.taken = 0;
+}
+
+/**
+ * @brief Sells a single line item, the same as selling a shopping list with this line item only.
+ *
+ * @param[in] name name of the product, may contain one spelling mistake. Looking it up does not allocate
+ * @param[in] count items to sell
+ *
+ * @returns number of items which could not be sold, 0 if the whole line item was sold
+ */
+int CSupermarket::sell(string_view name, int count)
+{
+  DU5_TIMED(SELL);
+  uint32_t product = name_pool.find(name);
+  if (product == CNamePool::NOT_FOUND && findTypo(name, product) != 1)
+    return count;
+
+  bool sold_out;
+  bool line_sold = sellBatches(product, count, sold_out);
+  if (sold_out)
+    eraseProduct(product);
+  return line_sold ? 0 : count;
+}
+
+/** @brief Stores products in the map.
+ *
+ * @param[in] name name of the product, looking it up does not allocate. It is copied only for a new product.
+ * @param[in] expiry_date is added to the list of batches.
+ * @param[in] count is added to the list of batches.
+ *
+ * In this method we store products as interned names(ids) and their expiry date and count as a sorted list of
+ * batches. This is the best way to do it, as it takes O(1) on average for finding the product and O(log n) for finding
+ * the batch. Firstly, we check if product we want to add is already in the name_pool. Secondly, CBatchList::insert()
+ * binary searches the expiry date among the batches. In case we found one, it just adds the count to the product_count
+ * field, otherwise it inserts a new batch at its position. Finally, if we didn`t find any products with matching name,
+ * then we add it as a new product.
+ *
+ * @returns current object with newly stored objects
+ */
+CSupermarket &CSupermarket::store(string_view name, const CDate &expiry_date, const int count)
+{
+  DU5_TIMED(STORE);
+  operation_log.append(COperationLog::STORE, name, dayNumber(expiry_date), count);
+  uint32_t product = name_pool.find(name); // id of the product with same name
+  if (product == CNamePool::NOT_FOUND)
+    product = addProduct(string(name)); // create new product
+  if (product_list[product].insert(CProduct{expiry_date, count})) // create new batch or merge it into the existing one
+    expiry_index.insert(CExpiryEntry{expiry_date, product});
+  return *this;
+}
+
+/** @brief Stores a whole inventory feed at once.
+ *
+ * @param[in] records feed lines, pass them with std::move to let the names move into the pool
+ *
+ * Calling store() for every line hashes the name and binary searches the batches once per line and inserts the new
+ * batches one by one. Here every known name is hashed once, new names are counted, the pool is reserved for the
+ * distinct ones and they are moved into it. The batches of the feed are then grouped by product with a counting pass
+ * (ingest_groups numbers the products of the feed) and only the dates of each product are sorted. Every product then
+ * merges all its new batches in a single pass over its CBatchList. The time is O(n + sum of g log g) for n records
+ * and g records per product. The result is the same as storing the lines one by one.
+ *
+ * @returns current object with newly stored objects
+ */
+CSupermarket &CSupermarket::storeAll(vector<CStoreRecord> records)
+{
+  DU5_TIMED(STORE_ALL);
+  vector<uint32_t> products(records.size()); // resolved product of every record
+  vector<size_t> unknown;                    // records whose name is not in the pool yet
+  for (size_t record = 0; record < records.size(); record++) // resolving the names, one hash per record
+  {
+    operation_log.append(COperationLog::STORE, records[record].name, dayNumber(records[record].expiry_date),
+                         records[record].count);
+    if ((products[record] = name_pool.find(records[record].name)) == CNamePool::NOT_FOUND)
+      unknown.push_back(record);
+  }
+  if (!unknown.empty()) // the pool and typo_index grow once, by the distinct new names
+  {
+    unordered_set<string_view> new_names(unknown.size());
+    size_t signatures = 0; // one typo_index entry per letter of a new name
+    for (size_t record : unknown)
+      if (new_names.insert(records[record].name).second)
+        signatures += records[record].name.size();
+    name_pool.reserve(name_pool.size() + new_names.size());
+    typo_index.reserve(typo_index.size() + signatures);
+  }
+  for (size_t record : unknown) // the first record of a new name moves it into the pool, the next ones find it
+    if ((products[record] = name_pool.find(records[record].name)) == CNamePool::NOT_FOUND)
+      products[record] = addProduct(move(records[record].name));
+
+  if (ingest_groups.size() < product_list.size())
+    ingest_groups.resize(product_list.size());
+  vector<uint32_t> group_products; // products of the feed in the order of their first record
+  vector<size_t> group_begin(1, 0);
+  for (uint32_t product : products) // counting the batches of every product
+  {
+    if (ingest_groups[product] == 0)
+    {
+      group_products.push_back(product);
+      group_begin.push_back(0);
+      ingest_groups[product] = group_products.size();
+    }
+    group_begin[ingest_groups[product]]++;
+  }
+  for (size_t group = 1; group < group_begin.size(); group++) // counts -> bucket boundaries
+    group_begin[group] += group_begin[group - 1];
+  vector<CProduct> grouped(records.size(), CProduct{CDate(1970, 1, 1), 0}); // the feed, bucket after bucket
+  vector<size_t> group_end(group_begin.begin(), group_begin.end() - 1);
+  for (size_t record = 0; record < records.size(); record++)
+    grouped[group_end[ingest_groups[products[record]] - 1]++] = CProduct{records[record].expiry_date,
+                                                                          records[record].count};
+
+  vector<CProduct> fresh_batches; // batches of the current product with dates it does not have yet
+  for (size_t group = 0; group < group_products.size(); group++)
+  {
+    uint32_t product = group_products[group];
+    ingest_groups[product] = 0;
+    CBatchList &batches = product_list[product];
+    sort(grouped.begin() + group_begin[group], grouped.begin() + group_begin[group + 1], set_cmp());
+    fresh_batches.clear();
+    for (size_t index = group_begin[group]; index < group_begin[group + 1]; index++)
+    {
+      const CProduct &batch = grouped[index];
+      if (!fresh_batches.empty() && fresh_batches.back().expire_date == batch.expire_date)
+        fresh_batches.back().product_count += batch.product_count;
+      else if (CProduct *existing = batches.find(batch.expire_date))
+        existing->product_count += batch.product_count;
+      else
+        fresh_batches.push_back(batch);
+    }
+    batches.mergeSorted(fresh_batches.data(), fresh_batches.data() + fresh_batches.size());
+    for (auto const &batch : fresh_batches)
+      expiry_index.insert(CExpiryEntry{batch.expire_date, product});
+  }
+  return *this;
+}
+
+/**
+ * @brief Creating a list of products which have expired before the date in the parameters of function call
+ *
+ * @param[in] date date we are comparing with
+ *
+ * Time complexity is O(k log k), where k is the number of expired batches. Batches are kept in expiry_index ordered by
+ * their expiry date, so we only walk the batches older than the date and stop at the first fresh one. Products which
+ * have no expired batches are never touched. The sums are sorted in descending order by count.
+ *
+ * @returns list of expired products
+ */
+list<pair<string, int>> CSupermarket::expired(const CDate &date) const
+{
+  return collectExpired(expiry_index.begin(), expiry_index.lower_bound(CExpiryEntry{date, 0}));
+}
+
+/**
+ * @brief Creating a list of products whose batches expire in the interval [from, to)
+ *
+ * @param[in] from first expiry date to report
+ * @param[in] to batches expiring at this date or later are not reported
+ *
+ * Same as expired(to) restricted to the batches that expired(from) does not report, so a periodic sweep pays only for
+ * the batches which expired since the previous cutoff. Counts reflect the current stock.
+ *
+ * @returns list of products expired between the two cutoffs, empty if from is not lower than to
+ */
+list<pair<string, int>> CSupermarket::expired(const CDate &from, const CDate &to) const
+{
+  if (!(from < to))
+    return list<pair<string, int>>();
+  return collectExpired(expiry_index.lower_bound(CExpiryEntry{from, 0}),
+                        expiry_index.lower_bound(CExpiryEntry{to, 0}));
+}
+
+/**
+ * @brief Allocation free variant of expired(date), the result is written into a reusable buffer
+ *
+ * @param[in] date date we are comparing with
+ * @param[out] result cleared and filled with the expired products, sorted in descending order by count
+ */
+void CSupermarket::expired(const CDate &date, CResultBuffer &result) const
+{
+  DU5_TIMED(EXPIRED);
+  result.clear();
+  sumExpired(expiry_index.begin(), expiry_index.lower_bound(CExpiryEntry{date, 0}), [&](uint32_t product, int sum)
+             { result.add(name_pool.name(product), sum, result.size()); });
+  result.sortByCount();
+}
+
+/** @brief Allocation free variant of expired(from, to), see expired(date, result) */
+void CSupermarket::expired(const CDate &from, const CDate &to, CResultBuffer &result) const
+{
+  DU5_TIMED(EXPIRED);
+  result.clear();
+  if (!(from < to))
+    return;
+  sumExpired(expiry_index.lower_bound(CExpiryEntry{from, 0}), expiry_index.lower_bound(CExpiryEntry{to, 0}),
+             [&](uint32_t product, int sum)
+             { result.add(name_pool.name(product), sum, result.size()); });
+  result.sortByCount();
+}
+
+/**
+ * @brief Incremental variant of expired() for periodic sweeps
+ *
+ * @param[in] date new cutoff date
+ *
+ * The first call behaves like expired(date). Every next call reports only the batches between the previous cutoff and
+ * the new one. A cutoff lower than the previous one reports nothing and keeps the previous cutoff.
+ *
+ * @returns list of products expired since the previous call
+ */
+list<pair<string, int>> CSupermarket::expiredSinceLastCall(const CDate &date)
+{
+  if (!sweep_started)
+  {
+    sweep_started = true;
+    last_cutoff = date;
+    return expired(date);
+  }
+  if (!(last_cutoff < date))
+    return list<pair<string, int>>();
+  list<pair<string, int>> expired_products = expired(last_cutoff, date);
+  last_cutoff = date;
+  return expired_products;
+}
+
+list<pair<string, int>> CSupermarket::collectExpired(set<CExpiryEntry, expiry_cmp>::const_iterator first,
+                                                     set<CExpiryEntry, expiry_cmp>::const_iterator last) const
+{
+  DU5_TIMED(EXPIRED);
+  vector<pair<uint32_t, int>> product_sums;
+  sumExpired(first, last, [&](uint32_t product, int sum)
+             { product_sums.emplace_back(product, sum); });
+  list<pair<string, int>> expired_products = namedList(product_sums);
+  expired_products.sort(pairComparator);
+  return expired_products;
+}
+
+/**
+ * @brief Writes off batches which expired more than grace_days before today
+ *
+ * @param[in] today current date, batches expiring before today - grace_days are dropped
+ * @param[in] grace_days how long expired stock is kept, for example until it is returned to the supplier
+ *
+ * Otherwise batches leave only through sell(), so expired stock which is never sold stays in product_list and
+ * expiry_index forever and every later expired() and sell() has to step over it. expiry_index is ordered by date, so
+ * it already works as the time wheel: the batches to drop are its first k entries, and as they are the oldest batches
+ * of their products, they are popped from the front of their CBatchList in the order of the index. That takes
+ * O(k log n) for k dropped batches, the stock which stays is not visited. Products left without batches are erased from name_pool,
+ * typo_index and product_list like sold out ones, batch lists which are mostly empty now give their memory back. With
+ * an open operation log every dropped batch is logged as a POP and every erased product as an ERASE, so recover()
+ * repeats the purge.
+ *
+ * @returns written off products and their counts, sorted like the result of expired()
+ */
+list<pair<string, int>> CSupermarket::purge(const CDate &today, int grace_days)
+{
+  DU5_TIMED(PURGE);
+  const CDate cutoff = today.addDays(-grace_days);
+  auto last = expiry_index.lower_bound(CExpiryEntry{cutoff, 0});
+  vector<pair<uint32_t, int>> product_sums;
+  sumExpired(expiry_index.begin(), last, [&](uint32_t product, int sum)
+             { product_sums.emplace_back(product, sum); });
+  list<pair<string, int>> written_off = namedList(product_sums); // before the names are released
+  written_off.sort(pairComparator);
+
+  for (auto entry = expiry_index.begin(); entry != last; ++entry)
+  {
+    CBatchList &batches = product_list[entry->product]; // entry is the oldest batch left
+    operation_log.append(COperationLog::POP, name_pool.name(entry->product), dayNumber(entry->expire_date), 0);
+    batches.popFront();
+    if (batches.empty())
+      eraseProduct(entry->product);
+    else if (!(batches.front().expire_date < cutoff)) // the last batch of the product to drop
+      batches.shrinkToFit();
+  }
+  expiry_index.erase(expiry_index.begin(), last);
+  return written_off;
+}
+
+list<pair<string, int>> CSupermarket::namedList(const vector<pair<uint32_t, int>> &sums) const
+{
+  list<pair<string, int>> expired_products;
+  for (auto const &product : sums)
+    expired_products.push_back(make_pair(name_pool.name(product.first), product.second)); // adding a new pair to the list
+  return expired_products;
+}
+
+/**
+ * @brief Creating a list of products which have expired before the date, aggregated by several threads
+ *
+ * @param[in] date date we are comparing with
+ * @param[in] threads number of worker threads, 0 or 1 falls back to the sequential expired(date)
+ *
+ * Meant for big reports, where a large part of the catalogue is expired. The products are split into chunks by id, the
+ * workers sum up the expired batches of every product in their chunk and sort the partial results, which are merged
+ * pairwise in parallel at the end. The order is the same as in expired(date), descending by count, equal counts in the
+ * order of the oldest expired batch of the product.
+ *
+ * @returns list of expired products
+ */
+list<pair<string, int>> CSupermarket::expired(const CDate &date, unsigned threads) const
+{
+  if (threads <= 1)
+    return expired(date);
+  DU5_TIMED(EXPIRED);
+  return namedList(sumExpiredParallel(date, SIZE_MAX, threads));
+}
+
+/**
+ * @brief Creating a list of at most top products with the most expired items
+ *
+ * @param[in] date date we are comparing with
+ * @param[in] top maximal length of the list
+ * @param[in] threads number of worker threads, see expired(date, threads)
+ *
+ * Only the best entries are selected (partial sort), so the full result is never sorted. Products with the same count
+ * on the border of the list may be chosen in any order.
+ *
+ * @returns list of at most top expired products, descending by count
+ */
+list<pair<string, int>> CSupermarket::expiredTop(const CDate &date, size_t top, unsigned threads) const
+{
+  DU5_TIMED(EXPIRED);
+  auto count_cmp = [](const pair<uint32_t, int> &x, const pair<uint32_t, int> &y)
+  { return y.second < x.second; };
+  if (threads > 1)
+    return namedList(sumExpiredParallel(date, top, threads));
+
+  vector<pair<uint32_t, int>> product_sums;
+  sumExpired(expiry_index.begin(), expiry_index.lower_bound(CExpiryEntry{date, 0}), [&](uint32_t product, int sum)
+             { product_sums.emplace_back(product, sum); });
+  top = min(top, product_sums.size());
+  partial_sort(product_sums.begin(), product_sums.begin() + top, product_sums.end(), count_cmp);
+  product_sums.resize(top);
+  return namedList(product_sums);
+}
+
+vector<pair<uint32_t, int>> CSupermarket::sumExpiredParallel(const CDate &date, size_t top, unsigned threads) const
+{
+  // equal counts are ordered like in expiry_index (by the oldest batch, then by id), which is the order of expired(date)
+  auto count_cmp = [this](const pair<uint32_t, int> &x, const pair<uint32_t, int> &y)
+  {
+    if (x.second != y.second)
+      return y.second < x.second;
+    const CDate &x_oldest = product_list[x.first].begin()->expire_date;
+    const CDate &y_oldest = product_list[y.first].begin()->expire_date;
+    if (!(x_oldest == y_oldest))
+      return x_oldest < y_oldest;
+    return x.first < y.first;
+  };
+  size_t chunk_size = max<size_t>((product_list.size() + threads * 4 - 1) / (threads * 4), 1);
+  vector<vector<pair<uint32_t, int>>> partial((product_list.size() + chunk_size - 1) / chunk_size);
+  atomic<uint64_t> scanned(0);
+
+  runParallel(threads, partial.size(), [&](size_t chunk)
+              {
+                size_t last = min(product_list.size(), (chunk + 1) * chunk_size);
+                uint64_t chunk_scanned = 0;
+                for (size_t product = chunk * chunk_size; product < last; product++) // batches are sorted by date
+                {
+                  int sum = 0;
+                  for (auto const &batch : product_list[product])
+                  {
+                    if (!(batch.expire_date < date))
+                      break;
+                    sum += batch.product_count;
+                    chunk_scanned++;
+                  }
+                  if (sum != 0)
+                    partial[chunk].emplace_back(product, sum);
+                }
+                if (partial[chunk].size() > top)
+                {
+                  partial_sort(partial[chunk].begin(), partial[chunk].begin() + top, partial[chunk].end(), count_cmp);
+                  partial[chunk].resize(top);
+                }
+                else
+                  sort(partial[chunk].begin(), partial[chunk].end(), count_cmp);
+                scanned += chunk_scanned;
+              });
+  DU5_RECORD(batches_per_expired, scanned.load());
+
+  while (partial.size() > 1) // merging neighbouring chunks until only one is left
+  {
+    vector<vector<pair<uint32_t, int>>> merged((partial.size() + 1) / 2);
+    runParallel(threads, merged.size(), [&](size_t pair_index)
+                {
+                  if (2 * pair_index + 1 == partial.size())
+                  {
+                    merged[pair_index].swap(partial[2 * pair_index]);
+                    return;
+                  }
+                  auto const &left = partial[2 * pair_index], &right = partial[2 * pair_index + 1];
+                  merged[pair_index].resize(min(left.size() + right.size(), top));
+                  auto out = merged[pair_index].begin();
+                  auto l = left.begin(), r = right.begin();
+                  for (; out != merged[pair_index].end(); ++out) // merge which stops after top entries
+                    *out = (r == right.end() || (l != left.end() && !count_cmp(*r, *l))) ? *l++ : *r++;
+                });
+    partial.swap(merged);
+  }
+  return partial.empty() ? vector<pair<uint32_t, int>>() : move(partial[0]);
+}
+
+void CSupermarket::runParallel(unsigned threads, size_t tasks, const function<void(size_t)> &task)
+{
+  CWorkerPool::global().run(threads, tasks, task);
+}
+
+/**
+ * @brief Starts logging the effects of store() and sell() to the file, see COperationLog
+ *
+ * @param[in] path log file, records which are there already are kept, so pass the log which recover() read
+ * @param[in] group_bytes records are written and synced once this many bytes are buffered, 0 syncs every record
+ *
+ * The log holds effects, not requests: stored batches, items taken from a batch, sold out batches and erased products.
+ * Replaying them needs no name resolution and gives the product the same id as before.
+ *
+ * @returns false if the file can not be opened
+ */
+bool CSupermarket::openLog(const string &path, size_t group_bytes)
+{
+  return operation_log.open(path, group_bytes);
+}
+
+/** @brief writes the buffered log records and waits for the disk, call it where the changes have to be durable */
+bool CSupermarket::syncLog()
+{
+  return operation_log.sync();
+}
+
+uint64_t CSupermarket::snapshotChecksum(const char *data, size_t length)
+{
+  uint64_t hash = 0xcbf29ce484222325ULL; // FNV-1a over whole words, the tail byte by byte
+  size_t pos = 0;
+  for (uint64_t word; pos + sizeof(word) <= length; pos += sizeof(word))
+  {
+    memcpy(&word, data + pos, sizeof(word));
+    hash = (hash ^ word) * HASH_BASE;
+  }
+  for (; pos < length; pos++)
+    hash = (hash ^ (unsigned char)data[pos]) * HASH_BASE;
+  return hash;
+}
+
+/**
+ * @brief Writes all products into a compact binary snapshot
+ *
+ * @param[in] path the snapshot is written next to it and renamed over it, so the old one stays valid until the end
+ *
+ * Behind CSnapshotHeader every kind of data is one contiguous array, in this order: name lengths and batch counts
+ * per id, released ids, dates and counts of all batches (ordered by id and date) and all names. Loading it is then a
+ * single sequential read. Ids stay the same, so the log which follows the snapshot replays to the same state. The log
+ * is synced first and its size is stored in the snapshot, recover() replays only the records behind it.
+ *
+ * @returns false if the snapshot (or the log) can not be written
+ */
+bool CSupermarket::saveSnapshot(const string &path)
+{
+  if (operation_log.isOpen() && !operation_log.sync())
+    return false;
+  vector<uint32_t> name_lengths(name_pool.slots()), batch_counts(name_pool.slots());
+  vector<int32_t> dates, counts;
+  string names;
+  dates.reserve(expiry_index.size());
+  counts.reserve(expiry_index.size());
+  for (uint32_t product = 0; product < name_pool.slots(); product++)
+  {
+    name_lengths[product] = name_pool.name(product).size();
+    names += name_pool.name(product);
+    batch_counts[product] = product_list[product].size();
+    for (auto const &batch : product_list[product])
+    {
+      dates.push_back(dayNumber(batch.expire_date));
+      counts.push_back(batch.product_count);
+    }
+  }
+  const vector<uint32_t> &free_ids = name_pool.freeIds();
+
+  CSnapshotHeader header{};
+  memcpy(header.magic, "DU5SNAP", 8);
+  header.version = SNAPSHOT_VERSION;
+  header.slots = name_pool.slots();
+  header.free_ids = free_ids.size();
+  header.batches = dates.size();
+  header.name_bytes = names.size();
+  header.log_offset = operation_log.isOpen() ? operation_log.syncedSize() : 0;
+  header.last_cutoff = dayNumber(last_cutoff);
+  header.sweep_started = sweep_started;
+  string contents;
+  contents.reserve(sizeof(header) + 8 * name_pool.slots() + 4 * free_ids.size() + 8 * dates.size() + names.size());
+  contents.append(sizeof(header), '\0');
+  auto appendArray = [&contents](const void *data, size_t bytes)
+  {
+    if (bytes != 0)
+      contents.append(static_cast<const char *>(data), bytes);
+  };
+  appendArray(name_lengths.data(), name_lengths.size() * sizeof(uint32_t));
+  appendArray(batch_counts.data(), batch_counts.size() * sizeof(uint32_t));
+  appendArray(free_ids.data(), free_ids.size() * sizeof(uint32_t));
+  appendArray(dates.data(), dates.size() * sizeof(int32_t));
+  appendArray(counts.data(), counts.size() * sizeof(int32_t));
+  contents += names;
+  header.checksum = snapshotChecksum(contents.data() + sizeof(header), contents.size() - sizeof(header));
+  memcpy(&contents[0], &header, sizeof(header));
+
+  string temporary = path + ".tmp";
+  FILE *file = fopen(temporary.c_str(), "wb");
+  if (!file)
+    return false;
+  bool written = fwrite(contents.data(), 1, contents.size(), file) == contents.size() && fflush(file) == 0 &&
+                 DU5_FSYNC(file) == 0;
+  written = fclose(file) == 0 && written;
+  return written && rename(temporary.c_str(), path.c_str()) == 0;
+}
+
+bool CSupermarket::loadSnapshot(const string &path, uint64_t &log_offset)
+{
+  FILE *file = fopen(path.c_str(), "rb");
+  if (!file)
+    return false;
+  string contents;
+  if (fseek(file, 0, SEEK_END) == 0)
+  {
+    long size = ftell(file);
+    if (size > 0 && fseek(file, 0, SEEK_SET) == 0)
+    {
+      contents.resize(size);
+      contents.resize(fread(&contents[0], 1, size, file)); // the single sequential read
+    }
+  }
+  fclose(file);
+
+  CSnapshotHeader header;
+  if (contents.size() < sizeof(header))
+    return false;
+  memcpy(&header, contents.data(), sizeof(header));
+  uint64_t expected_size = sizeof(header) + 8ULL * header.slots + 4ULL * header.free_ids + 8ULL * header.batches +
+                           header.name_bytes;
+  if (memcmp(header.magic, "DU5SNAP", 8) != 0 || header.version != SNAPSHOT_VERSION ||
+      contents.size() != expected_size || header.free_ids > header.slots ||
+      snapshotChecksum(contents.data() + sizeof(header), contents.size() - sizeof(header)) != header.checksum)
+    return false;
+
+  const char *position = contents.data() + sizeof(header);
+  auto readArray = [&position](auto &array, size_t count)
+  {
+    array.resize(count);
+    if (count != 0)
+      memcpy(array.data(), position, count * sizeof(array[0]));
+    position += count * sizeof(array[0]);
+  };
+  vector<uint32_t> name_lengths, batch_counts, free_ids;
+  vector<int32_t> dates, counts;
+  readArray(name_lengths, header.slots);
+  readArray(batch_counts, header.slots);
+  readArray(free_ids, header.free_ids);
+  readArray(dates, header.batches);
+  readArray(counts, header.batches);
+
+  *this = CSupermarket();
+  deque<string> names;
+  vector<bool> is_free(header.slots);
+  for (uint32_t id : free_ids)
+  {
+    if (id >= header.slots || is_free[id])
+      return false;
+    is_free[id] = true;
+  }
+  uint64_t name_bytes = 0, batch_index = 0;
+  vector<CProduct> batches;
+  vector<CExpiryEntry> entries;
+  entries.reserve(header.batches);
+  product_list.resize(header.slots);
+  for (uint32_t product = 0; product < header.slots; product++)
+  {
+    if (header.name_bytes - name_bytes < name_lengths[product] || header.batches - batch_index < batch_counts[product])
+      return false;
+    names.emplace_back(position, name_lengths[product]);
+    position += name_lengths[product];
+    name_bytes += name_lengths[product];
+    batches.clear();
+    for (uint32_t batch = 0; batch < batch_counts[product]; batch++, batch_index++)
+    {
+      CDate date = CDate(1970, 1, 1).addDays(dates[batch_index]);
+      if (!batches.empty() && !(batches.back().expire_date < date))
+        return false;
+      batches.push_back(CProduct{date, counts[batch_index]});
+      entries.push_back(CExpiryEntry{date, product});
+    }
+    if (is_free[product] && !batches.empty())
+      return false;
+    product_list[product].mergeSorted(batches.data(), batches.data() + batches.size());
+  }
+  if (name_bytes != header.name_bytes || batch_index != header.batches)
+    return false;
+  name_pool.assign(move(names), move(free_ids));
+  if (name_pool.size() != header.slots - header.free_ids) // duplicate names
+    return false;
+  typo_index.reserve(header.name_bytes); // one signature per letter
+  for (uint32_t product = 0; product < header.slots; product++)
+    if (!is_free[product])
+      indexName(product);
+  sort(entries.begin(), entries.end(), expiry_cmp());
+  for (auto const &entry : entries) // sorted input makes every insertion O(1)
+    expiry_index.insert(expiry_index.end(), entry);
+  last_cutoff = CDate(1970, 1, 1).addDays(header.last_cutoff);
+  sweep_started = header.sweep_started;
+  log_offset = header.log_offset;
+  return true;
+}
+
+bool CSupermarket::applyLogRecord(COperationLog::EOperation operation, string_view name, int day, int count)
+{
+  CDate date = CDate(1970, 1, 1).addDays(day);
+  if (operation == COperationLog::STORE)
+  {
+    store(name, date, count);
+    return true;
+  }
+  uint32_t product = name_pool.find(name);
+  if (product == CNamePool::NOT_FOUND)
+    return false;
+  CBatchList &batches = product_list[product];
+  switch (operation)
+  {
+  case COperationLog::TAKE:
+    if (batches.empty() || !(batches.front().expire_date == date))
+      return false;
+    batches.front().product_count -= count;
+    return true;
+  case COperationLog::POP:
+    if (batches.empty() || !(batches.front().expire_date == date))
+      return false;
+    expiry_index.erase(CExpiryEntry{date, product});
+    batches.popFront();
+    return true;
+  case COperationLog::ERASE:
+    if (!batches.empty())
+      return false;
+    eraseProduct(product);
+    return true;
+  default:
+    return false;
+  }
+}
+
 /**
- * @brief Class implementing comparison between two dates.
+ * @brief Rebuilds the market after a restart from the last snapshot and the log written since
  *
- * For comparing dates we should overload at least two operators(in our case "<" and "==") as we can evaluate the third
- * operator(">") just by using else statement.
+ * @param[in] snapshot_path snapshot written by saveSnapshot(), a missing file means an empty market
+ * @param[in] log_path operation log, only the records behind the offset stored in the snapshot are replayed. A record
+ *            torn by a crash at its end is cut off
+ *
+ * The current contents and the open log are dropped. Logging is off afterwards, call openLog(log_path) to go on.
+ *
+ * @returns false if the snapshot is damaged or the log does not belong to it, the market is left empty then
  */
-class CDate
+bool CSupermarket::recover(const string &snapshot_path, const string &log_path)
 {
-
-public:
-  // ~СDate
-  /*
-   * We do not need a destructor: When CDate object gets destructed, the default destructor is called.
-   * This destructor calls destructor of every attribute of the class (int year, month, date).
-   * Integers don`t have to be implicitly deallocated.
-   */
-
-  // parameterized constructor for initializing all attributes of the class
-  CDate(int y, int m, int d) : year(y), month(m), day(d){};
-
-  /**
-   * @brief overloaded operator two compare contents of CDate classes
-   *
-   * @param[in] t object to compare
-   * @returns  true if lvalue is lower than rvalue, or else if lvalue is bigger than rvalue
-   */
-  bool operator<(const CDate &t) const
+  *this = CSupermarket();
+  uint64_t log_offset = 0;
+  if (FILE *snapshot = fopen(snapshot_path.c_str(), "rb"))
   {
-    return tie(year, month, day) < tie(t.year, t.month, t.day);
+    fclose(snapshot);
+    if (!loadSnapshot(snapshot_path, log_offset))
+    {
+      *this = CSupermarket();
+      return false;
+    }
   }
-
-  // same logic as in the overloaded operator before
-  bool operator==(const CDate &t) const
+  if (!COperationLog::replay(log_path, log_offset, [this](COperationLog::EOperation operation, string_view name,
+                                                          int day, int count)
+                             { return applyLogRecord(operation, name, day, count); }))
   {
-    return tie(year, month, day) == tie(t.year, t.month, t.day);
+    *this = CSupermarket();
+    return false;
   }
-
-private:
-  int year, month, day;
-};
+  return true;
+}
 
 /**
- * Main class which implements storing, selling and finding expired products. The most convenient container for doing
- * these kinds of operations is unordered map with set as value, as it allows to have constant time complexity for all
- * basic operations. Our class has a initializing constructor for our map and doesn`t have a destructor, as a default would
- * be enough. As you can notice, in private members we have a struct CProduct, which is responsible for a better storage
- * of product variables(expiry date and count in our case), and struct set_cmp, which is basically a comparator function
- * for our set(value) in unordered_map.
+ * @brief Thread safe variant of CSupermarket.
+ *
+ * Products are split into shards by the hash of their name, every shard is a CSupermarket guarded by its own
+ * reader/writer lock. store() and sell() of products in different shards run in parallel and expired() reads the
+ * shards one after another under a shared lock, so an expiry sweep never blocks the whole store. No thread ever holds
+ * two locks at once, so there is no lock order to care about.
+ *
+ * Every line item of a shopping list is sold atomically under the lock of its shard. A name with a spelling mistake is
+ * resolved against all shards first (each of them under a shared lock) and the found product is then sold under the
+ * lock of its shard, if it is still there. Like in CSupermarket::sell(), products sold out by a shopping list are
+ * erased after the whole list, unless somebody restocked them in the meantime. Until then other threads see them as
+ * products without any batches.
  */
-class CSupermarket
+class CConcurrentSupermarket
 {
-
 public:
-  // initializing constructor for our unordered_map.
-  CSupermarket() : product_list(){};
-  CSupermarket &store(const string &name, const CDate &expiry_date, int count);
-  friend bool getRealName(CSupermarket &obj, string &product_validate);
+  explicit CConcurrentSupermarket(size_t shard_count = 16);
+  CConcurrentSupermarket &store(string_view name, const CDate &expiry_date, int count);
   list<pair<string, int>> sell(list<pair<string, int>> &shoppingList);
+  int sell(string_view name, int count);
   list<pair<string, int>> expired(const CDate &date) const;
+  list<pair<string, int>> purge(const CDate &today, int grace_days = 0);
 
 private:
-  /** @brief struct for convenient storage of the date and product count. Used in set in unordered_map product_list */
-  struct CProduct
+  /** @brief one part of the products, guarded by its own lock */
+  struct CShard
   {
-    CDate expire_date;
-    mutable int product_count;
+    mutable shared_mutex lock;
+    CSupermarket market;
   };
 
-  /** @brief struct for custom set comparator. Compares two dates */
-  struct set_cmp // code from stack_overflow for a custom set comparator
+  CShard &shardOf(string_view name) const;
+  /**
+   * @brief Sells one line item, name resolution included.
+   * @param[in,out] name name of the product, replaced by the real name if it contained a spelling mistake
+   * @param[in,out] count items to sell, decreased like in CSupermarket::sellBatches()
+   * @param[in,out] sold_out names of the products sold out by this line item are appended here
+   * @returns true if the line item was sold completely, otherwise false
+   */
+  bool sellLine(string &name, int &count, vector<string> &sold_out);
+  /** @brief erases the sold out products which were not restocked since */
+  void eraseSoldOut(const vector<string> &sold_out);
+
+  vector<unique_ptr<CShard>> shards; // shared_mutex can not be moved, so shards are allocated one by one
+};
+
+CConcurrentSupermarket::CConcurrentSupermarket(size_t shard_count)
+{
+  shards.reserve(max<size_t>(shard_count, 1));
+  for (size_t shard = 0; shard < max<size_t>(shard_count, 1); shard++)
+    shards.push_back(make_unique<CShard>());
+}
+
+CConcurrentSupermarket::CShard &CConcurrentSupermarket::shardOf(string_view name) const
+{
+  return *shards[hash<string_view>()(name) % shards.size()];
+}
+
+CConcurrentSupermarket &CConcurrentSupermarket::store(string_view name, const CDate &expiry_date, int count)
+{
+  CShard &shard = shardOf(name);
+  unique_lock<shared_mutex> guard(shard.lock);
+  shard.market.store(name, expiry_date, count);
+  return *this;
+}
+
+bool CConcurrentSupermarket::sellLine(string &name, int &count, vector<string> &sold_out)
+{
   {
-    bool operator()(const CProduct &a, const CProduct &b) const
+    CShard &shard = shardOf(name);
+    unique_lock<shared_mutex> guard(shard.lock);
+    uint32_t product = shard.market.name_pool.find(name);
+    if (product != CNamePool::NOT_FOUND)
     {
-      return a.expire_date < b.expire_date;
+      bool product_sold_out;
+      bool line_sold = shard.market.sellBatches(product, count, product_sold_out);
+      if (product_sold_out)
+        sold_out.push_back(name);
+      return line_sold;
     }
-  };
+  }
 
-  unordered_map<string, set<CProduct, set_cmp>> product_list;
-};
+  string real_name; // the name has to be unique among all shards
+  int correct_words_cnt = 0;
+  for (auto const &shard : shards)
+  {
+    shared_lock<shared_mutex> guard(shard->lock);
+    uint32_t product;
+    int found = shard->market.findTypo(name, product);
+    if (found == 0)
+      continue;
+    correct_words_cnt += found;
+    if (correct_words_cnt > 1)
+      return false;
+    real_name = shard->market.name_pool.name(product);
+  }
+  if (correct_words_cnt != 1)
+    return false;
 
-/** @brief comparator function for pairs based on second value. Used for sorting pairs in function "expiry" */
-bool pairComparator(const pair<string, int> &x, const pair<string, int> &y)
+  name = real_name;
+  CShard &shard = shardOf(name);
+  unique_lock<shared_mutex> guard(shard.lock);
+  uint32_t product = shard.market.name_pool.find(name);
+  if (product == CNamePool::NOT_FOUND) // sold out and erased by somebody else in the meantime
+    return false;
+  bool product_sold_out;
+  bool line_sold = shard.market.sellBatches(product, count, product_sold_out);
+  if (product_sold_out)
+    sold_out.push_back(name);
+  return line_sold;
+}
+
+void CConcurrentSupermarket::eraseSoldOut(const vector<string> &sold_out)
 {
-  return (y.second < x.second);
+  for (auto const &name : sold_out)
+  {
+    CShard &shard = shardOf(name);
+    unique_lock<shared_mutex> guard(shard.lock);
+    uint32_t product = shard.market.name_pool.find(name);
+    if (product != CNamePool::NOT_FOUND && shard.market.product_list[product].empty())
+      shard.market.eraseProduct(product);
+  }
 }
+
 /**
- * @brief Helper function for finding products with one mistake in the spelling.
- * @param[in] obj gaining access to private members.
- * @param[in,out] product_validate product name to find and change if we found only one matching word
+ * @brief Sells products listed in the shopping list, see CSupermarket::sell()
  *
- * In this method we receive name of the product we want to potentially find in our unordered_map.
- * Time complexity of this function is O(n). Firstly, we have to iterate through every element, check if size matches and
- * then run an algorithm which compares individual letters and remembers how many mistakes were done before.
- * Consequently, if count of mistakes exceeds one, we go to another word and so on. Secondly, if ONLY
- * one word with single mistake was found, we make our product_validate equal to the name of the found products,
- * otherwise we return false.
+ * @param[in,out] shoppingList list of all products we have to sell
  *
- * @returns true if only one name with one mistake was found, otherwise returns false.
+ * Line items are sold one after another, each of them atomically under the lock of its shard.
+ *
+ * @returns shoppingList without sold products
  */
-bool getRealName(CSupermarket &obj, string &product_validate)
+list<pair<string, int>> CConcurrentSupermarket::sell(list<pair<string, int>> &shoppingList)
 {
-  string temp_product;                             // string for storing found word
-  int correct_words_cnt = 0;                       // count of words found with a single mistake
-  for (const auto &map_element : obj.product_list) // iterating through map elements
+  vector<string> sold_out;
+  for (auto product_buy = shoppingList.begin(); product_buy != shoppingList.end();) // iterating through shopping list
   {
-    if (map_element.first.size() != product_validate.size()) // size should be equal for comparing words
-      continue;
-    int mistake_counter = 0;
-    for (size_t letter = 0; letter < map_element.first.size(); letter++) // iterating through letters of names
+    if (sellLine(product_buy->first, product_buy->second, sold_out))
+      product_buy = shoppingList.erase(product_buy);
+    else
+      ++product_buy;
+  }
+  eraseSoldOut(sold_out);
+  return shoppingList;
+}
 
-      if (map_element.first[letter] != product_validate[letter])
-      {
-        mistake_counter++;
-        if (mistake_counter > 1)
-          break;
-      }
+/** @returns number of items which could not be sold, see CSupermarket::sell(string_view, int) */
+int CConcurrentSupermarket::sell(string_view name, int count)
+{
+  vector<string> sold_out;
+  string product_name(name);
+  bool line_sold = sellLine(product_name, count, sold_out);
+  eraseSoldOut(sold_out);
+  return line_sold ? 0 : count;
+}
 
-    if (mistake_counter == 1) // if the word has only one mistake we remember it and continue on with other words
+/**
+ * @brief Creating a list of products which have expired before the date, see CSupermarket::expired()
+ *
+ * Every shard is read under a shared lock, the already sorted partial lists are merged.
+ */
+list<pair<string, int>> CConcurrentSupermarket::expired(const CDate &date) const
+{
+  list<pair<string, int>> expired_products;
+  for (auto const &shard : shards)
+  {
+    list<pair<string, int>> shard_products;
     {
-      correct_words_cnt++;
-      if (correct_words_cnt > 1)
-        return false;
-      temp_product = map_element.first;
+      shared_lock<shared_mutex> guard(shard->lock);
+      shard_products = shard->market.expired(date);
     }
+    expired_products.merge(shard_products, pairComparator);
   }
-  if (correct_words_cnt == 1) // found the word to return
+  return expired_products;
+}
+
+/**
+ * @brief Writes off old batches in every shard, see CSupermarket::purge()
+ *
+ * The shards are purged one after another, each under its exclusive lock, the sorted partial lists are merged.
+ */
+list<pair<string, int>> CConcurrentSupermarket::purge(const CDate &today, int grace_days)
+{
+  list<pair<string, int>> written_off;
+  for (auto const &shard : shards)
   {
-    product_validate = temp_product;
-    return true;
+    list<pair<string, int>> shard_products;
+    {
+      unique_lock<shared_mutex> guard(shard->lock);
+      shard_products = shard->market.purge(today, grace_days);
+    }
+    written_off.merge(shard_products, pairComparator);
   }
-  else
-    return false;
+  return written_off;
 }
+
+#ifndef __PROGTEST__
+#ifdef DU5_BENCHMARK
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#include <sys/wait.h>
+#endif
+
+/** @brief single lock baseline, this is how a service has to use CSupermarket from many threads */
+class CLockedSupermarket
+{
+public:
+  CLockedSupermarket &store(string_view name, const CDate &expiry_date, int count)
+  {
+    lock_guard<mutex> guard(lock);
+    market.store(name, expiry_date, count);
+    return *this;
+  }
+  int sell(string_view name, int count)
+  {
+    lock_guard<mutex> guard(lock);
+    return market.sell(name, count);
+  }
+  list<pair<string, int>> expired(const CDate &date) const
+  {
+    lock_guard<mutex> guard(lock);
+    return market.expired(date);
+  }
+
+private:
+  mutable mutex lock;
+  CSupermarket market;
+};
+
 /**
- * @brief Sells products listed in the shopping list
+ * @brief Runs a mixed workload on the market from the given number of threads.
  *
- * @param[in,out] shoppingList list of all products we have to sell
- *
- *  Firstly, we check if product to sell is present in our products_list(unordered_map), this operation takes O(n)
- *  as we should account for a mistake in spelling of a product`s name. If we found the product, we iterate through
- *  it`s set and subtract the count of products beginning from the oldest(with lowest expiry date). Secondly, we
- *  should check whether we have deleted all structs from the set, in this case we delete a whole map element with
- *  the corresponding name. Structs from the set are deleted after each iteration through
- *  shoppingList(this is the most efficient way to do it). Sold items and map element are deleted after the whole
- *  iteration of shoppingList.
+ * Every thread does 60 % single line sales, 39 % stores and 1 % expiry sweeps over a catalogue of products. Sold and
+ * stored items are counted, at the end the stock which is left has to match them exactly.
  *
- * @returns shoppingList without sold products
+ * @returns operations per second
  */
-list<pair<string, int>> CSupermarket::sell(list<pair<string, int>> &shoppingList)
+template <typename T_>
+double runMixedWorkload(T_ &market, int threads, int operations, int catalogue)
 {
-  vector<list<pair<string, int>>::iterator> pair_to_delete;                              // vector to store pairs to delete from shoppingList (list)
-  vector<unordered_map<string, set<CProduct, set_cmp>>::iterator> map_element_to_delete; // vector to store map_elements to delete from product_list  (map)
+  const CDate start(2020, 1, 1);
+  atomic<long long> stored(0), sold(0);
+  for (int product = 0; product < catalogue; product++)
+  {
+    market.store("product" + to_string(product), start.addDays(product % 365), 100);
+    stored += 100;
+  }
 
-  for (auto product_buy = shoppingList.begin(); product_buy != shoppingList.end(); ++product_buy) // iterating through shopping list
+  auto begin = chrono::steady_clock::now();
+  vector<thread> workers;
+  for (int worker = 0; worker < threads; worker++)
+    workers.emplace_back([&, worker]()
+                         {
+                           mt19937 generator(worker + 1);
+                           char name[32];
+                           for (int operation = 0; operation < operations / threads; operation++)
+                           {
+                             unsigned dice = generator() % 100;
+                             int length = snprintf(name, sizeof(name), "product%u", (unsigned)(generator() % catalogue));
+                             if (dice < 60)
+                             {
+                               int count = 1 + generator() % 3;
+                               sold += count - market.sell(string_view(name, length), count);
+                             }
+                             else if (dice < 99)
+                             {
+                               int count = 1 + generator() % 5;
+                               market.store(string_view(name, length), start.addDays(generator() % 365), count);
+                               stored += count;
+                             }
+                             else
+                               market.expired(start.addDays(3));
+                           }
+                         });
+  for (auto &worker : workers)
+    worker.join();
+  double seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+
+  long long left = 0;
+  for (auto const &product : market.expired(CDate(9999, 12, 31)))
+    left += product.second;
+  if (left != stored - sold)
   {
-    if (product_list.count(product_buy->first) != 0 || getRealName(*this, product_buy->first)) // checking if element exists
-    {
-      auto const &product = product_list.find(product_buy->first); // iterator to the element in the map with same name as we are looking for
-      vector<set<CProduct, set_cmp>::iterator> struct_to_delete;   // vector to store structs to delete from product_list.second  (set)
+    printf("stress check failed: stored %lld, sold %lld, left %lld\n", (long long)stored, (long long)sold, left);
+    exit(EXIT_FAILURE);
+  }
+  return (operations / threads) * threads / seconds;
+}
 
-      for (auto set_it = product->second.begin(); set_it != product->second.end(); ++set_it) // iterating through set of structs
-      {
-        if (set_it->product_count < product_buy->second)
-        {
-          product_buy->second = product_buy->second - set_it->product_count;
-          struct_to_delete.push_back(set_it);
-          continue; // intentional continue
-        }
-        else if (set_it->product_count == product_buy->second)
-        {
-          pair_to_delete.push_back(product_buy);
-          struct_to_delete.push_back(set_it);
-          break; // intentional break to iterate through shopping list
-        }
-        else
-        {
-          set_it->product_count = set_it->product_count - product_buy->second;
-          pair_to_delete.push_back(product_buy);
-          break; // intentional break to iterate through shopping list
-        }
-      }
-      for (auto &t : struct_to_delete) // clearing memory allocated for empty structs in the product_list.second  (set)
+/** @brief benchmark parameters given as key=value arguments, missing keys take the defaults */
+class CBenchmarkArgs
+{
+public:
+  CBenchmarkArgs(int argc, char *argv[])
+  {
+    for (int index = 1; index < argc; index++)
+    {
+      const char *separator = strchr(argv[index], '=');
+      if (!separator)
       {
-        product_list[product->first].erase(t);
-        if (product_list[product->first].size() == 0  ) // if value is empty - add the corresponding element to the "cleaning" vector
-          map_element_to_delete.push_back(product);
+        fprintf(stderr, "expected key=value, got %s\n", argv[index]);
+        exit(EXIT_FAILURE);
       }
+      values[string(argv[index], separator - argv[index])] = separator + 1;
     }
   }
-  for (auto &t : pair_to_delete) // clearing memory allocated for empty products in shopping list  (list)
+  bool has(const string &key) const { return values.count(key) != 0; }
+  string text(const string &key, const string &fallback) const
   {
-    shoppingList.erase(t);
+    auto it_value = values.find(key);
+    return it_value == values.end() ? fallback : it_value->second;
   }
-  for (auto &t : map_element_to_delete) // clearing memory allocated for empty products in the product_list  (map)
+  long long integer(const string &key, long long fallback) const
   {
-    product_list.erase(t);
+    return has(key) ? atoll(values.at(key).c_str()) : fallback;
   }
+  double real(const string &key, double fallback) const { return has(key) ? atof(values.at(key).c_str()) : fallback; }
 
-  return shoppingList;
-}
+private:
+  map<string, string> values;
+};
 
-/** @brief Stores products in the map.
- *
- * @param[in] name is used as a key in unordered_map.
- * @param[in] expiry_date is added to set of structs.
- * @param[in] count is added to set of structs.
+/**
+ * @brief Latencies of single measured calls, summarized as JSON members.
  *
- * In this method we store products as strings(key) and their expiry date and count as a set of structs(value).
- * This is the best way to do it, as it takes O(1) on average for all operations.
- * Firstly, we check if product we want to add is already in the unordered_map. Secondly, we check if the
- * expiry date of the product to add matches one of the dates in a set of structs. In case we found one, just
- * add the count to the product_count field. If there are no instances found with same expiry date, then we just
- * create another struct in the set with fields initialized as function parameters. Finally, if we didn`t find
- * any products with matching name, then we insert it as a new element in unordered_map.
+ * Only the time inside the calls counts, the preparation of their arguments does not. A call may cover several
+ * operations (a batch of baskets), the throughput is then in operations and the percentiles are per call.
+ */
+class CLatencies
+{
+public:
+  template <typename F_>
+  void measure(F_ call, size_t operation_count = 1)
+  {
+    auto begin = chrono::steady_clock::now();
+    call();
+    samples.push_back(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - begin).count());
+    operations += operation_count;
+  }
+  string json()
+  {
+    sort(samples.begin(), samples.end());
+    double seconds = 0;
+    for (long long sample : samples)
+      seconds += sample / 1e9;
+    auto percentile = [this](double q)
+    { return samples.empty() ? 0 : samples[min(samples.size() - 1, static_cast<size_t>(q * samples.size()))]; };
+    char json[320];
+    snprintf(json, sizeof(json),
+             "\"operations\":%zu,\"calls\":%zu,\"seconds\":%.6f,\"ops_per_second\":%.0f,\"p50_ns\":%lld,"
+             "\"p90_ns\":%lld,\"p99_ns\":%lld,\"p999_ns\":%lld,\"max_ns\":%lld",
+             operations, samples.size(), seconds, seconds > 0 ? operations / seconds : 0.0, percentile(0.5),
+             percentile(0.9), percentile(0.99), percentile(0.999), samples.empty() ? 0 : samples.back());
+    return json;
+  }
+
+private:
+  vector<long long> samples; // nanoseconds per call
+  size_t operations = 0;
+};
+
+/** @returns high water mark of the resident memory of this process in kB, -1 where it is not known */
+long peakMemoryKb()
+{
+#if defined(__unix__) || defined(__APPLE__)
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+  return usage.ru_maxrss / 1024; // in bytes there
+#else
+  return usage.ru_maxrss;
+#endif
+#else
+  return -1;
+#endif
+}
+
+/** @brief runs body in a child process where possible, so that every case reports its own peak memory */
+void runIsolated(const function<void()> &body)
+{
+#if defined(__unix__) || defined(__APPLE__)
+  fflush(stdout);
+  pid_t child = fork();
+  if (child == 0)
+  {
+    body();
+    fflush(stdout);
+    _exit(EXIT_SUCCESS);
+  }
+  int status;
+  if (child > 0)
+  {
+    if (waitpid(child, &status, 0) != child || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+    {
+      fprintf(stderr, "benchmark case failed\n");
+      exit(EXIT_FAILURE);
+    }
+    return;
+  }
+#endif
+  body();
+}
+
+/**
+ * @brief Parameters of one synthetic CSupermarket workload.
  *
- * @returns current object with newly stored objects
+ * The catalogue has products random lower case names of 6 to 12 letters, which are practically never one letter
+ * apart, so every misspelled name resolves to its product. Each product gets batches stores of 1 to 100 items
+ * expiring on random days of 2020. A sell workload checks out operations baskets of basket line items (1 to 5
+ * items of a random product, misspelled in one letter with probability typo_rate) through the list, span or
+ * batched sell(), the batched one batch baskets per call. An expired workload asks for the expired stock on
+ * operations random days.
  */
-CSupermarket &CSupermarket::store(const string &name, const CDate &expiry_date, const int count)
+struct CMarketWorkload
 {
-  if (product_list.count(name) == 0)
+  explicit CMarketWorkload(const CBenchmarkArgs &args)
+      : workload(args.text("workload", "sell")), api(args.text("api", "list")),
+        products(args.integer("products", 50000)), batches(args.integer("batches", 4)),
+        basket(args.integer("basket", 8)), batch(args.integer("batch", 16)),
+        operations(args.integer("operations", 100000)), threads(args.integer("threads", 4)),
+        typo_rate(args.real("typo_rate", 0.05)), seed(args.integer("seed", 1))
   {
-    set<CSupermarket::CProduct, set_cmp> to_ins = {CProduct{expiry_date, count}};
-    product_list.insert(make_pair(name, to_ins)); // create new map element
   }
-  else
+
+  void run() const
   {
-    auto const &product = product_list.find(name); // iterator to the element in map with same name
+    mt19937 generator(seed);
+    unordered_set<string> unique;
+    vector<string> names;
+    while (names.size() < products)
+    {
+      string name(6 + generator() % 7, ' ');
+      for (char &letter : name)
+        letter = 'a' + generator() % 26;
+      if (unique.insert(name).second)
+        names.push_back(move(name));
+    }
+    const CDate start(2020, 1, 1);
+    auto pick = [&]()
+    {
+      string name = names[generator() % products];
+      if (generator() % 1000000 < typo_rate * 1000000)
+      {
+        char &letter = name[generator() % name.size()];
+        letter = 'a' + (letter - 'a' + 1 + generator() % 25) % 26;
+      }
+      return name;
+    };
+
+    CSupermarket market;
+    CLatencies latencies;
+    for (size_t store = 0; store < products * batches; store++) // interleaved, the product changes every time
+    {
+      CDate expiry = start.addDays(generator() % 366);
+      int count = 1 + generator() % 100;
+      if (workload == "store")
+        latencies.measure([&]() { market.store(names[store % products], expiry, count); });
+      else
+        market.store(names[store % products], expiry, count);
+    }
 
-    for (auto set_it : product->second) // iterating through set of structs
+    if (workload == "sell" && api == "list")
+      for (size_t checkout = 0; checkout < operations; checkout++)
+      {
+        list<pair<string, int>> shopping_list;
+        for (size_t line = 0; line < basket; line++)
+          shopping_list.emplace_back(pick(), 1 + generator() % 5);
+        latencies.measure([&]() { market.sell(shopping_list); });
+      }
+    else if (workload == "sell")
     {
-      if (set_it.expire_date == expiry_date)
+      size_t per_call = api == "batched" ? batch : 1;
+      vector<string> line_names(per_call * basket);
+      vector<CSupermarket::CLineItem> items(line_names.size());
+      vector<CSupermarket::CBasket> baskets(per_call);
+      vector<CSupermarket::CResultBuffer> unsold(per_call);
+      for (size_t checkout = 0; checkout < operations; checkout += per_call)
+      {
+        for (size_t line = 0; line < items.size(); line++)
+        {
+          line_names[line] = pick();
+          items[line] = CSupermarket::CLineItem{line_names[line], static_cast<int>(1 + generator() % 5)};
+        }
+        for (size_t index = 0; index < per_call; index++)
+          baskets[index] = CSupermarket::CBasket{items.data() + index * basket, basket};
+        if (api == "batched")
+          latencies.measure([&]() { market.sell(baskets.data(), baskets.size(), unsold); }, per_call);
+        else
+          latencies.measure([&]() { market.sell(items.data(), items.size(), unsold[0]); });
+      }
+    }
+    else if (workload == "expired")
+      for (size_t call = 0; call < operations; call++)
       {
-        set_it.product_count += count;
-        return *this;
+        CDate date = start.addDays(generator() % 366);
+        latencies.measure([&]() { market.expired(date); });
       }
-    }                                                        // intentional dropdown
-    product_list[name].insert(CProduct{expiry_date, count}); // create new struct in the set
+
+    printf("{\"benchmark\":\"du5\",\"workload\":\"%s\",\"api\":\"%s\",\"products\":%zu,\"batches\":%zu,\"basket\":%zu,"
+           "\"batch\":%zu,\"typo_rate\":%g,\"seed\":%u,%s,\"peak_rss_kb\":%ld}\n",
+           workload.c_str(), api.c_str(), products, batches, basket, batch, typo_rate, seed, latencies.json().c_str(),
+           peakMemoryKb());
   }
-  return *this;
-}
+
+  /** @brief the mixed workload of runMixedWorkload() on a single lock market and on CConcurrentSupermarket */
+  void runConcurrent() const
+  {
+    CLockedSupermarket locked;
+    CConcurrentSupermarket sharded(64);
+    double locked_speed = runMixedWorkload(locked, threads, operations, products);
+    double sharded_speed = runMixedWorkload(sharded, threads, operations, products);
+    printf("{\"benchmark\":\"du5\",\"workload\":\"concurrent\",\"products\":%zu,\"threads\":%zu,\"operations\":%zu,"
+           "\"single_lock_ops_per_second\":%.0f,\"sharded_ops_per_second\":%.0f,\"peak_rss_kb\":%ld}\n",
+           products, threads, operations, locked_speed, sharded_speed, peakMemoryKb());
+  }
+
+  string workload, api;
+  size_t products, batches, basket, batch, operations, threads;
+  double typo_rate;
+  unsigned seed;
+};
 
 /**
- * @brief Creating a list of products which have expired before the date in the parameters of function call
- *
- * @param[in] date date we are comparing with
+ * @brief Benchmark driver, prints one JSON object per case and line.
  *
- * Time complexity is O(n). Firstly, we iterate through every element of the map. Secondly, in each element we iterate
- * through set of structs and compare date(function parameter) with expiry_date of the individual product. If item
- * has been already expired, then we add its name and count of the products as a pair to the list we want to return.
- * Finally, after all iterations are done, we sort the resulting list in descending order by count, it takes O(nlogn).
- *
- * @returns list of expired products
+ * Parameters are key=value arguments: workload (store, sell, expired, concurrent), api (list, span, batched),
+ * products, batches, basket, batch, operations, threads, typo_rate and seed. With a workload only that case runs,
+ * without one a fixed matrix of the cases runs, each in a process of its own. The same seed gives the same workload.
  */
-list<pair<string, int>> CSupermarket::expired(const CDate &date) const
+int main(int argc, char *argv[])
 {
-  list<pair<string, int>> expired_products;
-  for (auto const &product : product_list) // iterating through map
+  CBenchmarkArgs args(argc, argv);
+  CMarketWorkload base(args);
+  vector<CMarketWorkload> cases;
+  if (args.has("workload"))
+    cases.push_back(base);
+  else
   {
-    pair<string, int> product_pair{product.first, 0}; // creating pair to push at the back
-    for (auto set_it : product.second)                // iterating through set
+    for (const char *workload : {"store", "expired"})
+    {
+      cases.push_back(base);
+      cases.back().workload = workload;
+      if (cases.back().workload == "expired" && !args.has("operations"))
+        cases.back().operations = 200;
+    }
+    for (double typo_rate : {0.0, 0.05})
+      for (const char *api : {"list", "span", "batched"})
+      {
+        cases.push_back(base);
+        cases.back().typo_rate = typo_rate;
+        cases.back().api = api;
+      }
+    for (size_t threads : {1, 2, 4, 8, 16})
     {
-      if (set_it.expire_date < date)
-        product_pair.second += set_it.product_count;
+      cases.push_back(base);
+      cases.back().workload = "concurrent";
+      cases.back().threads = threads;
+      if (!args.has("operations"))
+        cases.back().operations = 400000;
     }
-    if (product_pair.second != 0)
-      expired_products.push_back(product_pair); // adding a new pair to the list
   }
-  expired_products.sort(pairComparator);
-  return expired_products;
+  for (const CMarketWorkload &workload : cases)
+    runIsolated([&workload]()
+                { workload.workload == "concurrent" ? workload.runConcurrent() : workload.run(); });
+  return EXIT_SUCCESS;
 }
-#ifndef __PROGTEST__
+#else
 int main(void)
 {
   CSupermarket s;
@@ -422,6 +2955,273 @@ int main(void)
   assert(l15.size() == 1);
   assert((l15 == list<pair<string, int>>{{"ccccc", 10}}));
 
+  s.store("a?c", CDate(2019, 1, 1), 1)
+      .store("ab?", CDate(2019, 1, 1), 1);
+
+  list<pair<string, int>> l16{{"a?d", 1},
+                              {"xbc", 1}};
+  s.sell(l16);
+  assert((l16 == list<pair<string, int>>{{"xbc", 1}}));
+
+  list<pair<string, int>> l17{{"ab?", 1},
+                              {"abc", 1}};
+  s.sell(l17);
+  assert((l17 == list<pair<string, int>>{{"ab?", 1}}));
+
+  CSupermarket e;
+  e.store("milk", CDate(2020, 1, 10), 3)
+      .store("milk", CDate(2020, 1, 10), 4)
+      .store("milk", CDate(2020, 2, 10), 5)
+      .store("eggs", CDate(2020, 1, 20), 10);
+
+  assert((e.expired(CDate(2020, 1, 11)) == list<pair<string, int>>{{"milk", 7}}));
+  assert((e.expired(CDate(2020, 1, 11), CDate(2020, 3, 1)) == list<pair<string, int>>{{"eggs", 10},
+                                                                                       {"milk", 5}}));
+  assert(e.expired(CDate(2020, 3, 1), CDate(2020, 1, 1)).empty());
+
+  assert((e.expiredSinceLastCall(CDate(2020, 1, 11)) == list<pair<string, int>>{{"milk", 7}}));
+  assert(e.expiredSinceLastCall(CDate(2020, 1, 11)).empty());
+  assert((e.expiredSinceLastCall(CDate(2020, 1, 21)) == list<pair<string, int>>{{"eggs", 10}}));
+  assert((e.expiredSinceLastCall(CDate(2021, 1, 1)) == list<pair<string, int>>{{"milk", 5}}));
+
+  CSupermarket f;
+  f.store("tea", CDate(2020, 5, 1), 1)
+      .storeAll({{"tea", CDate(2020, 1, 1), 2},
+                 {"jam", CDate(2020, 3, 1), 4},
+                 {"tea", CDate(2020, 5, 1), 8},
+                 {"tea", CDate(2020, 1, 1), 16},
+                 {"tea", CDate(2020, 3, 1), 32}});
+  assert((f.expired(CDate(2020, 2, 1)) == list<pair<string, int>>{{"tea", 18}}));
+  assert((f.expired(CDate(2020, 4, 1)) == list<pair<string, int>>{{"tea", 50},
+                                                                  {"jam", 4}}));
+  list<pair<string, int>> l18{{"tea", 55},
+                              {"jam", 4}};
+  f.sell(l18);
+  assert(l18.empty());
+  assert((f.expired(CDate(2021, 1, 1)) == list<pair<string, int>>{{"tea", 4}}));
+
+  const char pos_buffer[] = "flour 2sugar 5";
+  f.store(string_view(pos_buffer, 5), CDate(2020, 6, 1), 10)
+      .store(string_view(pos_buffer + 7, 5), CDate(2020, 6, 1), 10);
+  assert(f.sell(string_view(pos_buffer, 5), 2) == 0);
+  assert(f.sell("suger", 15) == 5);
+  assert(f.sell("sugar", 1) == 1);
+  assert(f.sell("flout", 8) == 0);
+  assert((f.expired(CDate(2021, 1, 1)) == list<pair<string, int>>{{"tea", 4}}));
+
+  CSupermarket g = f;
+  g.store("flour", CDate(2020, 6, 1), 1);
+  f.store("flower", CDate(2020, 6, 1), 2);
+  assert((g.expired(CDate(2021, 1, 1)) == list<pair<string, int>>{{"tea", 4},
+                                                                  {"flour", 1}}));
+  assert((f.expired(CDate(2021, 1, 1)) == list<pair<string, int>>{{"tea", 4},
+                                                                  {"flower", 2}}));
+
+  CSupermarket h;
+  for (int product = 0; product < 200; product++)
+    h.store("item" + to_string(product), CDate(2020, 1, 1).addDays(product % 7), product % 13 + 1)
+        .store("item" + to_string(product), CDate(2020, 2, 1), 5);
+  list<pair<string, int>> sequential = h.expired(CDate(2020, 1, 5));
+  list<pair<string, int>> parallel = h.expired(CDate(2020, 1, 5), 4);
+  assert(sequential == parallel && is_sorted(parallel.begin(), parallel.end(), pairComparator));
+  list<pair<string, int>> top = h.expiredTop(CDate(2020, 1, 5), 10);
+  list<pair<string, int>> parallel_top = h.expiredTop(CDate(2020, 1, 5), 10, 3);
+  assert(top.size() == 10 && parallel_top.size() == 10);
+  assert(top.front().second == 13 && top.back().second == 12);
+  assert(parallel_top.front().second == 13 && parallel_top.back().second == 12);
+  assert(h.expiredTop(CDate(2020, 1, 1), 5, 2).empty());
+  vector<thread> reporters; // the reports share the threads of CWorkerPool::global()
+  atomic<int> mismatches(0);
+  for (int reporter = 0; reporter < 4; reporter++)
+    reporters.emplace_back([&]()
+                           { for (int round = 0; round < 20; round++)
+                               mismatches += h.expired(CDate(2020, 1, 5), 3) != sequential; });
+  for (auto &reporter : reporters)
+    reporter.join();
+  assert(mismatches == 0);
+
+  CSupermarket k;
+  k.store("soap", CDate(2021, 1, 1), 3)
+      .store("salt", CDate(2021, 2, 1), 5)
+      .store("rice", CDate(2021, 3, 1), 2);
+  const CSupermarket::CLineItem basket[] = {{"soap", 4}, {"rico", 2}, {"salt", 1}, {"soup", 1}};
+  CSupermarket::CResultBuffer unsold;
+  k.sell(basket, 4, unsold);
+  assert(unsold.size() == 2);
+  assert(unsold.line(0) == 0 && unsold.name(0) == "soap" && unsold.count(0) == 1);
+  assert(unsold.line(1) == 3 && unsold.name(1) == "soap" && unsold.count(1) == 1);
+  CSupermarket::CResultBuffer report;
+  k.expired(CDate(2022, 1, 1), report);
+  assert(report.size() == 1 && report.name(0) == "salt" && report.count(0) == 4);
+  k.expired(CDate(2021, 1, 1), CDate(2021, 2, 1), report);
+  assert(report.empty());
+
+  CSupermarket m;
+  m.store("coke", CDate(2021, 1, 1), 2)
+      .store("cake", CDate(2021, 1, 1), 1)
+      .store("milk", CDate(2021, 1, 1), 3)
+      .store("milk", CDate(2021, 2, 1), 3);
+  const CSupermarket::CLineItem first[] = {{"cake", 1}, {"milk", 2}, {"cuke", 1}};
+  const CSupermarket::CLineItem second[] = {{"milk", 2}, {"cake", 1}, {"cuke", 1}, {"milk", 1}};
+  const CSupermarket::CLineItem third[] = {{"cuke", 2}, {"milk", 5}};
+  const CSupermarket::CBasket baskets[] = {{first, 3}, {second, 4}, {third, 2}};
+  vector<CSupermarket::CResultBuffer> basket_unsold;
+  m.sell(baskets, 3, basket_unsold);
+  assert(basket_unsold.size() == 3);
+  assert(basket_unsold[0].size() == 1 && basket_unsold[0].name(0) == "cuke" && basket_unsold[0].count(0) == 1);
+  assert(basket_unsold[1].empty()); // "cake" is erased, so "cake" and "cuke" both resolve to "coke"
+  assert(basket_unsold[2].size() == 2 && basket_unsold[2].name(0) == "cuke" && basket_unsold[2].count(0) == 2);
+  assert(basket_unsold[2].name(1) == "milk" && basket_unsold[2].count(1) == 4);
+  assert(m.expired(CDate(2022, 1, 1)).empty());
+
+  CSupermarket sequential_market, batched_market;
+  mt19937 generator(5);
+  for (int product = 0; product < 30; product++)
+  {
+    string name = "p" + to_string(product % 10) + "x" + to_string(product / 10);
+    for (CSupermarket *market : {&sequential_market, &batched_market})
+      market->store(name, CDate(2021, 1, 1).addDays(product % 4), 3).store(name, CDate(2021, 2, 1), 2);
+  }
+  vector<vector<CSupermarket::CLineItem>> random_baskets(50);
+  vector<string> random_names(400);
+  for (size_t item = 0; item < random_names.size(); item++)
+  {
+    random_names[item] = "p" + to_string(generator() % 12) + (generator() % 5 ? "x" : "y") + to_string(generator() % 3);
+    random_baskets[item % 50].push_back(CSupermarket::CLineItem{random_names[item], (int)(generator() % 4)});
+  }
+  vector<CSupermarket::CBasket> random_batch;
+  for (auto const &basket : random_baskets)
+    random_batch.push_back(CSupermarket::CBasket{basket.data(), basket.size()});
+  batched_market.sell(random_batch.data(), random_batch.size(), basket_unsold);
+  for (size_t basket = 0; basket < random_baskets.size(); basket++)
+  {
+    sequential_market.sell(random_baskets[basket].data(), random_baskets[basket].size(), unsold);
+    assert(unsold.size() == basket_unsold[basket].size());
+    for (size_t entry = 0; entry < unsold.size(); entry++)
+      assert(unsold.name(entry) == basket_unsold[basket].name(entry) &&
+             unsold.count(entry) == basket_unsold[basket].count(entry) &&
+             unsold.line(entry) == basket_unsold[basket].line(entry));
+  }
+  assert(sequential_market.expired(CDate(2022, 1, 1)) == batched_market.expired(CDate(2022, 1, 1)));
+
+  CSupermarket purged;
+  purged.store("milk", CDate(2020, 1, 1), 5).store("milk", CDate(2020, 1, 10), 3).store("milk", CDate(2020, 3, 1), 2);
+  purged.store("bread", CDate(2020, 1, 5), 4).store("cheese", CDate(2020, 1, 2), 0).store("ham", CDate(2020, 6, 1), 1);
+  for (int day = 1; day <= 20; day++)
+    purged.store("salt", CDate(2019, 1, day), 1);
+  purged.store("salt", CDate(2021, 1, 1), 1);
+  assert(purged.purge(CDate(2019, 1, 1), 30).empty());
+  assert((purged.purge(CDate(2020, 1, 20), 10) == list<pair<string, int>>{{"salt", 20}, {"milk", 5}, {"bread", 4}}));
+  assert((purged.expired(CDate(2020, 2, 1)) == list<pair<string, int>>{{"milk", 3}}));
+  assert(purged.sell("breaf", 1) == 1 && purged.sell("cheese", 1) == 1); // erased, no typo match either
+  assert((purged.purge(CDate(2020, 12, 31)) == list<pair<string, int>>{{"milk", 5}, {"ham", 1}}));
+  assert((purged.expired(CDate(2100, 1, 1)) == list<pair<string, int>>{{"salt", 1}}));
+  purged.store("milk", CDate(2022, 1, 1), 2);
+  assert(purged.sell("malk", 1) == 0 && purged.sell("salt", 2) == 1);
+
+  const char *snapshot_path = "DU5_snapshot.tmp", *log_path = "DU5_log.tmp";
+  remove(snapshot_path);
+  remove(log_path);
+  CSupermarket logged;
+  assert(logged.openLog(log_path, 64));
+  logged.store("tea", CDate(2020, 1, 1), 5).store("jam", CDate(2020, 2, 1), 4).store("tea", CDate(2020, 3, 1), 2);
+  list<pair<string, int>> l20{{"tea", 6}, {"jan", 4}};
+  logged.sell(l20);
+  assert(logged.saveSnapshot(snapshot_path));
+  logged.storeAll({{"rum", CDate(2020, 5, 1), 7}, {"jam", CDate(2020, 4, 1), 3}});
+  assert(logged.sell("tee", 1) == 0 && logged.sell("rum", 2) == 0);
+  assert(logged.syncLog());
+  logged.store("gin", CDate(2020, 6, 1), 9); // not synced, lost by the "crash" below
+  CSupermarket recovered;
+  assert(recovered.recover(snapshot_path, log_path));
+  assert((recovered.expired(CDate(2021, 1, 1)) == list<pair<string, int>>{{"rum", 5}, {"jam", 3}}));
+  assert(recovered.sell("rum", 1) == 0); // the names and the typo index are back
+  CSupermarket replayed;
+  assert(replayed.recover("DU5_missing.tmp", log_path)); // the whole log without a snapshot
+  assert((replayed.expired(CDate(2021, 1, 1)) == list<pair<string, int>>{{"rum", 5}, {"jam", 3}}));
+
+  FILE *torn_log = fopen(log_path, "ab"); // a record torn by a crash
+  assert(torn_log && fwrite("\x01\x02\x03", 1, 3, torn_log) == 3 && fclose(torn_log) == 0);
+  assert(recovered.recover(snapshot_path, log_path) && recovered.openLog(log_path));
+  recovered.store("ale", CDate(2020, 7, 1), 1);
+  assert(recovered.syncLog());
+  assert(replayed.recover(snapshot_path, log_path));
+  assert((replayed.expired(CDate(2021, 1, 1)) == list<pair<string, int>>{{"rum", 5}, {"jam", 3}, {"ale", 1}}));
+  assert((recovered.purge(CDate(2020, 6, 1), 14) == list<pair<string, int>>{{"rum", 5}, {"jam", 3}}));
+  assert(recovered.syncLog() && replayed.recover(snapshot_path, log_path));
+  assert((replayed.expired(CDate(2021, 1, 1)) == list<pair<string, int>>{{"ale", 1}}) && replayed.sell("rim", 1) == 1);
+  FILE *damaged = fopen(snapshot_path, "r+b");
+  assert(damaged && fseek(damaged, -1, SEEK_END) == 0 && fputc('x', damaged) != EOF && fclose(damaged) == 0);
+  assert(!replayed.recover(snapshot_path, log_path) && replayed.expired(CDate(2021, 1, 1)).empty());
+  assert(remove(snapshot_path) == 0 && remove(log_path) == 0);
+
+  CConcurrentSupermarket c(4);
+  c.store("Coke", CDate(2016, 12, 31), 10)
+      .store("cake", CDate(2016, 11, 1), 5)
+      .store("beer", CDate(2016, 8, 10), 50);
+  list<pair<string, int>> l19{{"Cake", 1},
+                              {"coke", 1},
+                              {"cake", 6},
+                              {"Cake", 1},
+                              {"bear", 25}};
+  c.sell(l19);
+  assert((l19 == list<pair<string, int>>{{"Cake", 1},
+                                         {"coke", 1},
+                                         {"cake", 1},
+                                         {"Cake", 1}}));
+
+  vector<thread> workers;
+  for (int worker = 0; worker < 4; worker++)
+    workers.emplace_back([&c]()
+                         {
+                           for (int i = 0; i < 1000; i++)
+                           {
+                             c.store("water", CDate(2017, 1, 1 + i % 28), 2);
+                             c.sell("water", 1);
+                           }
+                         });
+  for (auto &worker : workers)
+    worker.join();
+  assert((c.expired(CDate(2018, 1, 1)) == list<pair<string, int>>{{"water", 4000},
+                                                                  {"beer", 25},
+                                                                  {"Coke", 10}}));
+  assert((c.purge(CDate(2017, 1, 1)) == list<pair<string, int>>{{"beer", 25}, {"Coke", 10}}));
+  assert((c.expired(CDate(2018, 1, 1)) == list<pair<string, int>>{{"water", 4000}}));
+
+  CHistogram histogram;
+  for (uint64_t value = 1; value <= 100; value++)
+    histogram.record(value);
+  CHistogram::CSnapshot values = histogram.snapshot();
+  assert(values.count == 100 && values.sum == 5050 && values.buckets[7] == 37);
+  assert(values.quantile(0.5) == 63 && values.quantile(0.99) == 127 && values.quantile(1) == 127);
+  assert(CHistogram().snapshot().quantile(0.5) == 0);
+  CSupermarketMetrics::CSnapshot metrics = CSupermarketMetrics::global().snapshot();
+#ifdef DU5_METRICS
+  assert(metrics.latency[CSupermarketMetrics::STORE].count > 0 && metrics.latency[CSupermarketMetrics::SELL].count > 0);
+  assert(metrics.latency[CSupermarketMetrics::SELL_BATCH].count == 2 && metrics.batches_per_expired.count > 0);
+  assert(metrics.latency[CSupermarketMetrics::PURGE].count > 0);
+  assert(metrics.typo_attempts >= metrics.typo_hits + metrics.typo_ambiguous && metrics.typo_hits > 0);
+  assert(metrics.typo_ambiguous > 0 && metrics.typo_candidates > 0 && metrics.batches_per_line.sum > 0);
+#else
+  assert(metrics.latency[CSupermarketMetrics::SELL].count == 0 && metrics.typo_attempts == 0);
+#endif /* DU5_METRICS */
+  assert(CSupermarketMetrics::global().exportText().find("supermarket_typo_hits ") != string::npos);
+
+  static_assert(CDate(2016, 3, 1) - CDate(2016, 2, 28) == 2, "2016 is a leap year");
+  static_assert(CDate(1900, 2, 28).addDays(1) == CDate(1900, 3, 1), "1900 is not a leap year");
+  static_assert(CDate(1999, 12, 31) < CDate(2000, 1, 1), "comparison follows the calendar");
+  static_assert(CDate(2024, 2, 29).getMonth() == 2 && CDate(2024, 2, 29).getDay() == 29, "");
+  static_assert(!CDate::isValid(2023, 2, 29) && CDate::isValid(2000, 2, 29), "");
+  assert(sizeof(CDate) == sizeof(int));
+
+  CDate parsed(1970, 1, 1);
+  assert(CDate::parse("2019-03-11", parsed) && parsed == CDate(2019, 3, 11));
+  assert(parsed.getYear() == 2019 && parsed.getMonth() == 3 && parsed.getDay() == 11);
+  assert(!CDate::parse("2019-02-29", parsed) && parsed == CDate(2019, 3, 11));
+  assert(!CDate::parse("2019-3-11", parsed));
+  assert(!CDate::parse("2019/03/11", parsed));
+
   return EXIT_SUCCESS;
 }
+#endif /* DU5_BENCHMARK */
 #endif /* __PROGTEST__ */
@@ -26,67 +26,1654 @@
 using namespace std;
 #endif /* __PROGTEST__ */
 
+// not in the Progtest header set, the index itself needs them in both builds
+#include <iterator>
+#include <type_traits>
+#include <array>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <string_view>
+#include <stdexcept>
+#include <typeinfo>
+#include <chrono>
+#if __cplusplus >= 202002L
+#include <span>
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define CINDEX_SIMD_WIDTH 32
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define CINDEX_SIMD_WIDTH 16
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define CINDEX_MMAP
+#endif
+
+/**
+ * @brief Counters and latency histograms shared by all CIndex instantiations, recorded only with CINDEX_METRICS.
+ *
+ * Latencies go to log2 buckets of nanoseconds: bucket 0 holds zero, bucket b the range [2^(b-1), 2^b). Hot loops
+ * count into a local CTally which adds its total once, when the search returns. All counters are relaxed atomics, so
+ * snapshot() can be called from a monitoring thread at any time, the copy is consistent per counter. Without
+ * CINDEX_METRICS nothing is recorded and the snapshot stays zero.
+ */
+class CIndexMetrics
+{
+public:
+    enum EOperation
+    {
+        BUILD,       // suffix array construction of a new index
+        SEARCH,      // search(), searchVector(), searchBitmap() and forEachMatch()
+        COUNT,       // count()
+        FIND,        // findFirst() and contains()
+        SEARCH_ALL,  // searchAll() of a pattern set
+        APPROXIMATE, // searchApproximate()
+        APPEND,
+        OPERATIONS
+    };
+    static constexpr size_t buckets = 48;
+
+    struct CSnapshot
+    {
+        uint64_t latency[OPERATIONS][buckets]; // calls per bucket of nanoseconds
+        uint64_t calls[OPERATIONS];
+        uint64_t nanoseconds[OPERATIONS];
+        uint64_t suffix_probes; // suffixes compared with the pattern by the binary searches of the suffix arrays
+        uint64_t candidates;    // positions compared element by element by the scan matchers
+        uint64_t confirmed;     // matches reported
+        uint64_t kmp_fallbacks; // scans which switched to kmpSearch() on periodic input
+
+        /** @returns upper bound in nanoseconds of the bucket with the q-quantile call of operation */
+        uint64_t quantile(EOperation operation, double q) const
+        {
+            uint64_t rank = static_cast<uint64_t>(q * calls[operation]), seen = 0;
+            for (size_t bucket = 0; bucket < buckets; bucket++)
+            {
+                seen += latency[operation][bucket];
+                if (seen > rank || (seen == calls[operation] && seen != 0))
+                    return bucket == 0 ? 0 : (uint64_t(1) << bucket) - 1;
+            }
+            return 0;
+        }
+    };
+
+    static CIndexMetrics &global()
+    {
+        static CIndexMetrics metrics;
+        return metrics;
+    }
+
+    CSnapshot snapshot() const
+    {
+        CSnapshot copy{};
+        for (size_t operation = 0; operation < OPERATIONS; operation++)
+        {
+            for (size_t bucket = 0; bucket < buckets; bucket++)
+                copy.calls[operation] += copy.latency[operation][bucket] =
+                    latency[operation][bucket].load(memory_order_relaxed);
+            copy.nanoseconds[operation] = nanoseconds[operation].load(memory_order_relaxed);
+        }
+        copy.suffix_probes = suffix_probes.load(memory_order_relaxed);
+        copy.candidates = candidates.load(memory_order_relaxed);
+        copy.confirmed = confirmed.load(memory_order_relaxed);
+        copy.kmp_fallbacks = kmp_fallbacks.load(memory_order_relaxed);
+        return copy;
+    }
+
+    /** @brief snapshot as Prometheus text: calls, total time and p50/p99 per operation, then the counters */
+    string exportText() const
+    {
+        static const char *const names[OPERATIONS] = {"build", "search", "count", "find", "search_all",
+                                                      "approximate", "append"};
+        CSnapshot copy = snapshot();
+        ostringstream text;
+        for (size_t operation = 0; operation < OPERATIONS; operation++)
+        {
+            text << "cindex_" << names[operation] << "_ns_count " << copy.calls[operation] << '\n'
+                 << "cindex_" << names[operation] << "_ns_sum " << copy.nanoseconds[operation] << '\n';
+            for (double q : {0.5, 0.99})
+                text << "cindex_" << names[operation] << "_ns{quantile=\"" << q << "\"} "
+                     << copy.quantile(static_cast<EOperation>(operation), q) << '\n';
+        }
+        text << "cindex_suffix_probes " << copy.suffix_probes << '\n'
+             << "cindex_candidates " << copy.candidates << '\n'
+             << "cindex_confirmed " << copy.confirmed << '\n'
+             << "cindex_kmp_fallbacks " << copy.kmp_fallbacks << '\n';
+        return text.str();
+    }
+
+    void record(EOperation operation, uint64_t elapsed)
+    {
+        size_t bucket = elapsed == 0 ? 0 : min<size_t>(64 - __builtin_clzll(elapsed), buckets - 1);
+        latency[operation][bucket].fetch_add(1, memory_order_relaxed);
+        nanoseconds[operation].fetch_add(elapsed, memory_order_relaxed);
+    }
+
+    /** @brief measures its own lifetime as one call of operation */
+    struct CTimer
+    {
+        explicit CTimer(EOperation operation) : operation(operation), start(chrono::steady_clock::now()) {}
+        ~CTimer()
+        {
+            global().record(operation, chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() -
+                                                                                  start).count());
+        }
+        EOperation operation;
+        chrono::steady_clock::time_point start;
+    };
+
+    /** @brief local counter, adds its value to the global counter when it goes out of scope */
+    struct CTally
+    {
+        explicit CTally(atomic<uint64_t> CIndexMetrics::*counter) : counter(counter) {}
+        ~CTally()
+        {
+            if (value != 0)
+                (global().*counter).fetch_add(value, memory_order_relaxed);
+        }
+        void add(uint64_t more) { value += more; }
+        atomic<uint64_t> CIndexMetrics::*counter;
+        uint64_t value = 0;
+    };
+
+    /** @brief CTally of a build without CINDEX_METRICS, optimized away */
+    struct CNoTally
+    {
+        explicit CNoTally(atomic<uint64_t> CIndexMetrics::*) {}
+        void add(uint64_t) {}
+    };
+
+    atomic<uint64_t> latency[OPERATIONS][buckets] = {};
+    atomic<uint64_t> nanoseconds[OPERATIONS] = {};
+    atomic<uint64_t> suffix_probes{0}, candidates{0}, confirmed{0}, kmp_fallbacks{0};
+};
+
+#ifdef CINDEX_METRICS
+#define CINDEX_TIMED(operation) CIndexMetrics::CTimer operation_timer(CIndexMetrics::operation)
+#define CINDEX_TALLY(name, counter) CIndexMetrics::CTally name(&CIndexMetrics::counter)
+#define CINDEX_COUNT(counter, value) CIndexMetrics::global().counter.fetch_add((value), memory_order_relaxed)
+#else
+#define CINDEX_TIMED(operation)
+#define CINDEX_TALLY(name, counter) CIndexMetrics::CNoTally name(&CIndexMetrics::counter)
+#define CINDEX_COUNT(counter, value) ((void)(value))
+#endif /* CINDEX_METRICS */
+
+/**
+ * @brief Worker threads shared by the parallel searches of all CIndex instantiations.
+ *
+ * The threads are started by the first search which needs them (the pool grows to the most threads ever asked for)
+ * and then sleep between searches, so a search wakes threads up instead of creating and joining them. run() hands
+ * the tasks out one by one through an atomic counter, a thread which finishes early takes the next task, and the
+ * calling thread works too. One run() is executed at a time, concurrent callers wait for the previous one.
+ */
+class CWorkerPool
+{
+public:
+    static CWorkerPool &global()
+    {
+        static CWorkerPool pool;
+        return pool;
+    }
+    ~CWorkerPool()
+    {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto &worker : workers)
+            worker.join();
+    }
+
+    /** @brief calls task(0) ... task(tasks - 1) from threads threads, the calling one included, and waits for them */
+    void run(unsigned threads, size_t tasks, const function<void(size_t)> &task)
+    {
+        size_t helpers = min<size_t>(max(threads, 1u), tasks) - (tasks != 0);
+        if (helpers == 0)
+        {
+            for (size_t current = 0; current < tasks; current++)
+                task(current);
+            return;
+        }
+        lock_guard<mutex> run_guard(run_lock);
+        {
+            lock_guard<mutex> guard(lock);
+            while (workers.size() < helpers) // a new thread waits for the next generation, this one
+                workers.emplace_back(&CWorkerPool::serve, this, generation);
+            job = &task;
+            task_count = tasks;
+            next_task = 0;
+            wanted = active = helpers;
+            generation++;
+        }
+        wake.notify_all();
+        work();
+        unique_lock<mutex> guard(lock);
+        done.wait(guard, [this]() { return active == 0; });
+        job = nullptr;
+    }
+
+private:
+    CWorkerPool() = default;
+
+    void serve(uint64_t seen)
+    {
+        unique_lock<mutex> guard(lock);
+        while (true)
+        {
+            wake.wait(guard, [this, seen]() { return stopping || generation != seen; });
+            if (stopping)
+                return;
+            seen = generation;
+            if (wanted == 0) // enough threads joined this run
+                continue;
+            wanted--;
+            guard.unlock();
+            work();
+            guard.lock();
+            if (--active == 0)
+                done.notify_all();
+        }
+    }
+
+    void work()
+    {
+        for (size_t current = next_task++; current < task_count; current = next_task++)
+            (*job)(current);
+    }
+
+    mutex run_lock;            // one run() at a time
+    mutex lock;                // guards everything below but next_task
+    condition_variable wake;   // a new run or stopping
+    condition_variable done;   // active dropped to zero
+    vector<thread> workers;
+    const function<void(size_t)> *job = nullptr;
+    size_t task_count = 0;
+    atomic<size_t> next_task{0};
+    size_t wanted = 0, active = 0; // threads which still have to join the run / to finish it
+    uint64_t generation = 0;
+    bool stopping = false;
+};
+
+/**
+ * @brief Aho-Corasick automaton over a set of patterns, finds all of them in one pass over a source.
+ *
+ * The patterns form a trie whose transitions are maps ordered by compare_type, so elements which are equal by the
+ * comparator share a transition (upperCaseCompare puts 'a' and 'A' on the same edge) without any canonical form. Every
+ * node gets a failure link to the longest proper suffix of its path which is in the trie too, and an output link to
+ * the nearest such suffix where a pattern ends. The automaton is built once in O(total pattern length * log sigma)
+ * and can then be run over any number of sources in O(n log sigma + occ), independently of the number of patterns.
+ */
+template <typename T_, typename C_ = less<typename T_::value_type>>
+class CPatternSet
+{
+public:
+    CPatternSet(const vector<T_> &patterns, const C_ &compare_type = C_()) : patterns(patterns),
+                                                                            compare_type(compare_type)
+    {
+        nodes.emplace_back(compare_type);
+        for (uint32_t id = 0; id < patterns.size(); id++)
+        {
+            if (patterns[id].size() == 0)
+            {
+                empty_patterns.push_back(id);
+                continue;
+            }
+            uint32_t node = root;
+            for (const value_type &element : patterns[id])
+            {
+                auto it_next = nodes[node].next.find(element);
+                if (it_next == nodes[node].next.end())
+                {
+                    it_next = nodes[node].next.emplace(element, static_cast<uint32_t>(nodes.size())).first;
+                    nodes.emplace_back(compare_type);
+                }
+                node = it_next->second;
+            }
+            nodes[node].patterns.push_back(id);
+        }
+        buildLinks();
+    }
+
+    size_t size() const { return patterns.size(); }
+    const T_ &pattern(size_t id) const { return patterns[id]; }
+
+    /**
+     * @brief Calls report(id, pos) for every occurrence of pattern id starting at source position pos.
+     *
+     * Occurrences are reported in increasing order of their end, so the positions of each single pattern increase.
+     * An empty pattern occurs at every position of the source, like in CIndex::search().
+     */
+    template <typename F_>
+    void forEachMatch(const T_ &source, F_ report) const
+    {
+        uint32_t node = root;
+        size_t pos = 0;
+        for (auto it_source = source.begin(); it_source != source.end(); ++it_source, ++pos)
+        {
+            for (uint32_t id : empty_patterns)
+                report(id, pos);
+            auto it_next = nodes[node].next.find(*it_source);
+            while (node != root && it_next == nodes[node].next.end())
+            {
+                node = nodes[node].fail;
+                it_next = nodes[node].next.find(*it_source);
+            }
+            node = it_next == nodes[node].next.end() ? root : it_next->second;
+            for (uint32_t found = nodes[node].patterns.empty() ? nodes[node].output : node; found != root;
+                 found = nodes[found].output)
+                for (uint32_t id : nodes[found].patterns)
+                    report(id, pos + 1 - patterns[id].size());
+        }
+    }
+
+    /** @returns positions[id] = sorted start positions of pattern id in source */
+    vector<vector<size_t>> search(const T_ &source) const
+    {
+        vector<vector<size_t>> positions(patterns.size());
+        forEachMatch(source, [&positions](uint32_t id, size_t pos)
+                     { positions[id].push_back(pos); });
+        return positions;
+    }
+
+private:
+    typedef typename T_::value_type value_type;
+    static constexpr uint32_t root = 0;
+
+    struct CNode
+    {
+        CNode(const C_ &compare_type) : next(compare_type) {}
+
+        map<value_type, uint32_t, C_> next;
+        uint32_t fail = root;     // longest proper suffix of this node's path which is a trie node
+        uint32_t output = root;   // nearest node on the failure chain where a pattern ends, root if none
+        vector<uint32_t> patterns; // ids of the patterns ending here (equal patterns share a node)
+    };
+
+    /** @brief failure and output links in breadth-first order, a node's links only depend on shallower nodes */
+    void buildLinks()
+    {
+        queue<uint32_t> open;
+        for (auto &child : nodes[root].next)
+            open.push(child.second);
+        while (!open.empty())
+        {
+            uint32_t node = open.front();
+            open.pop();
+            for (auto &child : nodes[node].next)
+            {
+                uint32_t fail = nodes[node].fail;
+                auto it_next = nodes[fail].next.find(child.first);
+                while (fail != root && it_next == nodes[fail].next.end())
+                {
+                    fail = nodes[fail].fail;
+                    it_next = nodes[fail].next.find(child.first);
+                }
+                CNode &next = nodes[child.second];
+                next.fail = it_next == nodes[fail].next.end() ? root : it_next->second;
+                next.output = nodes[next.fail].patterns.empty() ? nodes[next.fail].output : next.fail;
+                open.push(child.second);
+            }
+        }
+    }
+
+    vector<T_> patterns;
+    C_ compare_type;
+    vector<CNode> nodes;             // nodes[root] is the empty prefix
+    vector<uint32_t> empty_patterns; // ids of the empty patterns, they match everywhere
+};
+
+/**
+ * @brief Index over a sequence which finds all positions of a subsequence.
+ *
+ * A suffix array of the source is built once in the constructor, together with its LCP array (longest common prefix of
+ * neighbouring suffixes). Suffixes are ordered lexicographically by compare_type, elements which are not lower than
+ * each other are equal. search() finds the first suffix starting with the pattern by binary search and then walks the
+ * LCP array while the neighbours share at least the pattern length, so a query costs O(m log n + occ).
+ *
+ * The suffix array costs O(n log n) to build and only pays off over many queries. An index which is queried once or
+ * twice can be built with SCAN, search() then runs a linear matcher over the source instead: Boyer-Moore-Horspool for
+ * random access sources and Knuth-Morris-Pratt for forward-only ones (list). Strings and vectors of char-like elements
+ * are scanned over their raw bytes instead: the comparator is probed once per index for the classes of equal bytes and
+ * whole SIMD blocks are filtered by the first and last byte of the pattern before any exact check.
+ *
+ * T_ may be a non-owning view (string_view, span under C++20), the index then keeps only the view and its own
+ * structures and the viewed memory has to outlive it. mapFile() maps a file read-only and indexes it through a
+ * string_view, the mapping is shared by all copies of the index and unmapped with the last one.
+ *
+ * With intern_tokens every element is replaced by an integer id once in the constructor, elements equal by compare_type
+ * share the id (CStrComparator(true) folds the case). The search structures are then built over the flat vector of
+ * ids and patterns are translated the same way, so matching compares integers instead of calling the comparator twice
+ * per element and walking a list. This suits sequences of words much better than the element by element path.
+ */
 template <typename T_, typename C_ = less<typename T_::value_type>>
 class CIndex
 {
 public:
-    CIndex(const T_ &source_type, const C_ &compare_type = C_()) : source_type(source_type),
-                                                                   compare_type(compare_type) {}
+    enum EMode
+    {
+        SUFFIX_ARRAY, // build a suffix array, O(n log n) once, O(m log n + occ) per search
+        SCAN          // no preprocessing, O(n + m) per search
+    };
+
+    CIndex(const T_ &source_type, const C_ &compare_type = C_(), EMode mode = SUFFIX_ARRAY, bool intern_tokens = false)
+        : CIndex(T_(source_type), compare_type, mode, nullptr, intern_tokens)
+    {
+    }
+    /** @brief takes over a temporary source instead of copying it */
+    CIndex(T_ &&source_type, const C_ &compare_type = C_(), EMode mode = SUFFIX_ARRAY, bool intern_tokens = false)
+        : CIndex(move(source_type), compare_type, mode, nullptr, intern_tokens)
+    {
+    }
+#ifdef CINDEX_MMAP
+    /**
+     * @brief Index over the contents of the file at path, which is mapped read-only instead of being read.
+     *
+     * Searches run directly over the page cache, the index owns only its auxiliary structures (none in SCAN mode).
+     * T_ has to be a view of char-like elements constructible from a pointer and a length, like string_view.
+     * @throws runtime_error if the file cannot be opened or mapped
+     */
+    static CIndex mapFile(const string &path, const C_ &compare_type = C_(), EMode mode = SUFFIX_ARRAY)
+    {
+        static_assert(byte_elements && is_constructible<T_, const value_type *, size_t>::value,
+                      "mapFile() needs a view of char-like elements, like string_view");
+        size_t size;
+        shared_ptr<const void> mapping = readFile(path, size);
+        T_ source(static_cast<const value_type *>(mapping.get()), size);
+        return CIndex(move(source), compare_type, mode, move(mapping), false);
+    }
+#endif /* CINDEX_MMAP */
+
+    /**
+     * @brief Writes the index to path as a snapshot, which load() maps back instead of rebuilding it.
+     *
+     * Layout, in native byte order with every part 8-byte aligned: CSnapshotHeader, (begin, end) of every segment,
+     * the source elements, then the suffix array and the LCP array of every segment as 64-bit words. The header holds
+     * the format version, a byte order mark, the element size, hashes of the element and comparator type names, the
+     * byte classes of the comparator and a checksum of everything behind it.
+     * @throws runtime_error if the file cannot be written or the index interns tokens
+     */
+    void save(const string &path) const
+    {
+        static_assert(is_trivially_copyable<value_type>::value && random_access && sizeof(size_t) == sizeof(uint64_t),
+                      "save() needs a random access source of trivially copyable elements");
+        if (token_index)
+            throw runtime_error("CIndex: an index with interned tokens cannot be saved");
+        CSnapshotHeader header = snapshotHeader(compare_type, mode, source_type.size(), segments.size());
+        header.byte_class = byte_class;
+
+        vector<uint64_t> table, elements((source_type.size() * sizeof(value_type) + 7) / 8, 0);
+        for (const CSegment &segment : segments)
+        {
+            table.push_back(segment.begin);
+            table.push_back(segment.end);
+        }
+        unsigned char *element_bytes = reinterpret_cast<unsigned char *>(elements.data());
+        for (size_t pos = 0; pos < source_type.size(); pos++)
+            memcpy(element_bytes + pos * sizeof(value_type), &elementAt(pos), sizeof(value_type));
+
+        FILE *file = fopen(path.c_str(), "wb");
+        if (!file)
+            throw runtime_error("CIndex: cannot create " + path);
+        bool written = fwrite(&header, sizeof(header), 1, file) == 1; // the checksum is filled in at the end
+        auto write = [&](const void *words, size_t count)
+        {
+            header.checksum = checksum(static_cast<const uint64_t *>(words), count, header.checksum);
+            written = written && (count == 0 || fwrite(words, sizeof(uint64_t), count, file) == count);
+        };
+        write(table.data(), table.size());
+        write(elements.data(), elements.size());
+        for (const CSegment &segment : segments)
+        {
+            write(segment.suffix_array, segment.length());
+            write(segment.lcp, segment.length());
+        }
+        written = written && fseek(file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, file) == 1;
+        if (fclose(file) != 0 || !written)
+            throw runtime_error("CIndex: cannot write " + path);
+    }
+
+    /**
+     * @brief Index from a snapshot written by save(), mapped read-only where mmap is available.
+     *
+     * The suffix and LCP arrays are used in place. A view T_ (string_view) uses the source in place too, an owning
+     * one gets a copy. Validation reads the file once: the header has to match this build and type, the checksum the
+     * contents, and the suffix arrays have to hold positions of their segments. The comparator is checked as well:
+     * char-like elements compare the byte classes of compare_type with the saved ones, and for all element types 64
+     * sampled neighbours of every suffix array have to be ordered by compare_type with the saved LCP.
+     * @throws runtime_error if the file cannot be read or is not a valid snapshot for this CIndex and comparator
+     */
+    static CIndex load(const string &path, const C_ &compare_type = C_())
+    {
+        static_assert(is_trivially_copyable<value_type>::value && random_access && sizeof(size_t) == sizeof(uint64_t),
+                      "load() needs a random access source of trivially copyable elements");
+        size_t size;
+        shared_ptr<const void> data = readFile(path, size);
+        auto invalid = [&path](const string &reason)
+        { return runtime_error("CIndex: " + path + " " + reason); };
+        if (size < sizeof(CSnapshotHeader))
+            throw invalid("is not a snapshot");
+        const CSnapshotHeader &header = *static_cast<const CSnapshotHeader *>(data.get());
+        CSnapshotHeader expected = snapshotHeader(compare_type, static_cast<EMode>(header.mode), 0, 0);
+        if (memcmp(header.magic, expected.magic, sizeof(header.magic)) != 0)
+            throw invalid("is not a snapshot");
+        if (header.version != expected.version || header.byte_order != expected.byte_order)
+            throw invalid("has an unsupported version or byte order");
+        if (header.element_size != expected.element_size || header.element_type != expected.element_type ||
+            header.comparator_type != expected.comparator_type || header.mode > SCAN)
+            throw invalid("was saved for another element type, comparator or mode");
+
+        const uint64_t *words = reinterpret_cast<const uint64_t *>(static_cast<const char *>(data.get()) + sizeof(header));
+        size_t word_count = (size - sizeof(header)) / 8, element_words = (header.length * sizeof(value_type) + 7) / 8;
+        if ((size - sizeof(header)) % 8 != 0 || header.segments > word_count / 2 ||
+            element_words > word_count - 2 * header.segments)
+            throw invalid("is truncated");
+        vector<CSegment> segments;
+        size_t used = 2 * header.segments + element_words;
+        for (size_t index = 0; index < header.segments; index++)
+        {
+            segments.emplace_back(words[2 * index], words[2 * index + 1]);
+            CSegment &segment = segments.back();
+            if (segment.begin != (index ? segments[index - 1].end : 0) || segment.end < segment.begin ||
+                segment.end > header.length || (index + 1 == header.segments && segment.end != header.length))
+                throw invalid("has a broken segment table");
+            if (segment.length() > (word_count - used) / 2)
+                throw invalid("is truncated");
+            segment.suffix_array = reinterpret_cast<const size_t *>(words + used);
+            segment.lcp = reinterpret_cast<const size_t *>(words + used + segment.length());
+            segment.storage = data;
+            used += 2 * segment.length();
+        }
+        if (used != word_count || checksum(words, word_count, 0) != header.checksum)
+            throw invalid("is corrupted");
+
+        const value_type *elements = reinterpret_cast<const value_type *>(words + 2 * header.segments);
+        T_ source = [&]()
+        {
+            if constexpr (is_constructible<T_, const value_type *, size_t>::value)
+                return T_(elements, header.length);
+            else
+                return T_(elements, elements + header.length);
+        }();
+        CIndex index(move(source), compare_type, static_cast<EMode>(header.mode), data, move(segments));
+        if (byte_elements && index.byte_class != header.byte_class)
+            throw invalid("was saved with another comparator");
+        for (const CSegment &segment : index.segments)
+            if (!index.validSegment(segment))
+                throw invalid("was saved with another comparator");
+        return index;
+    }
+    CIndex(const CIndex &src) : source_type(src.source_type), compare_type(src.compare_type), mode(src.mode),
+                                owner(src.owner), token_ids(src.token_ids), token_index(src.token_index),
+                                byte_class(src.byte_class), identity_classes(src.identity_classes),
+                                segments(src.segments)
+    {
+        buildElementPointers();
+    }
+    CIndex &operator=(const CIndex &src)
+    {
+        if (this != &src)
+        {
+            source_type = src.source_type;
+            compare_type = src.compare_type;
+            mode = src.mode;
+            owner = src.owner;
+            token_ids = src.token_ids;
+            token_index = src.token_index;
+            byte_class = src.byte_class;
+            identity_classes = src.identity_classes;
+            segments = src.segments;
+            buildElementPointers();
+        }
+        return *this;
+    }
     ~CIndex() {}
     set<size_t> search(const T_ &find_sequence) const
     {
-
         set<size_t> set_pos;
-        size_t pos_to_ins = 0;
+        forEachMatch(find_sequence, [&set_pos](size_t pos)
+                     { set_pos.insert(set_pos.end(), pos); });
+        return set_pos;
+    }
+
+    /**
+     * @brief searchVector() which scans the source with several threads, the result is the same.
+     *
+     * The start positions of a random access source in SCAN mode are cut into chunks, about 8 per thread and at least
+     * min_parallel_chunk long. Every chunk reads m - 1 elements past its end, so a match crossing a boundary is found
+     * only by the chunk it starts in and the hits are just concatenated in chunk order. The chunks are handed out one
+     * by one to the threads of CWorkerPool, which are kept between searches, and the calling thread works too, so a
+     * thread which finishes early takes over the remaining ones. Suffix array and forward-only indices are searched by
+     * the calling thread alone.
+     */
+    vector<size_t> searchVector(const T_ &find_sequence, unsigned threads) const
+    {
+        if (token_index)
+        {
+            vector<uint32_t> pattern;
+            return translate(find_sequence, pattern) ? token_index->searchVector(pattern, threads) : vector<size_t>();
+        }
+        size_t n = source_type.size();
+        if constexpr (random_access)
+            if (mode == SCAN && threads > 1 && find_sequence.size() != 0 && n > min_parallel_chunk)
+            {
+                CINDEX_TIMED(SEARCH);
+                size_t chunk_size = max(min_parallel_chunk, (n + 8 * threads - 1) / (8 * threads));
+                vector<vector<size_t>> partial((n + chunk_size - 1) / chunk_size);
+                runParallel(threads, partial.size(), [&](size_t chunk)
+                            { scanMatches(find_sequence, [&partial, chunk](size_t pos)
+                                          { partial[chunk].push_back(pos);
+                                            return true; },
+                                          chunk * chunk_size, (chunk + 1) * chunk_size); });
+                size_t total = 0;
+                for (const auto &hits : partial)
+                    total += hits.size();
+                vector<size_t> positions;
+                positions.reserve(total);
+                for (const auto &hits : partial)
+                    positions.insert(positions.end(), hits.begin(), hits.end());
+                CINDEX_COUNT(confirmed, total);
+                return positions;
+            }
+        return searchVector(find_sequence);
+    }
+    set<size_t> search(const T_ &find_sequence, unsigned threads) const
+    {
+        vector<size_t> positions = searchVector(find_sequence, threads);
+        return set<size_t>(positions.begin(), positions.end());
+    }
+
+    /** @returns positions[id] = sorted start positions of pattern id, all patterns are found in one pass */
+    vector<vector<size_t>> searchAll(const CPatternSet<T_, C_> &patterns) const
+    {
+        CINDEX_TIMED(SEARCH_ALL);
+        return patterns.search(source_type);
+    }
+    vector<vector<size_t>> searchAll(const vector<T_> &patterns) const
+    {
+        return searchAll(CPatternSet<T_, C_>(patterns, compare_type));
+    }
+
+    /** @brief same positions as search(), without a tree node per match */
+    vector<size_t> searchVector(const T_ &find_sequence) const
+    {
+        vector<size_t> positions;
         if (find_sequence.size() == 0)
+            positions.reserve(source_type.size());
+        forEachMatch(find_sequence, [&positions](size_t pos)
+                     { positions.push_back(pos); });
+        return positions;
+    }
+
+    /** @returns bitmap[pos] is set if a match starts at pos, one bit per source element */
+    vector<bool> searchBitmap(const T_ &find_sequence) const
+    {
+        vector<bool> bitmap(source_type.size(), false);
+        forEachMatch(find_sequence, [&bitmap](size_t pos)
+                     { bitmap[pos] = true; });
+        return bitmap;
+    }
+
+    /** @returns number of matches, read off the suffix array range without touching the positions */
+    size_t count(const T_ &find_sequence) const
+    {
+        if (token_index)
         {
-            for (size_t i = 0; i < source_type.size(); i++)
-                set_pos.insert(i);
-            return set_pos;
+            vector<uint32_t> pattern;
+            return translate(find_sequence, pattern) ? token_index->count(pattern) : 0;
         }
-        auto it_seq = find_sequence.begin();
-        for (auto it_source = source_type.begin(); it_source != source_type.end(); ++it_source, pos_to_ins++)
+        if (find_sequence.size() == 0)
+            return source_type.size();
+        CINDEX_TIMED(COUNT);
+        size_t matches = 0;
+        if (mode == SUFFIX_ARRAY)
         {
-            if (!(compare_type(*it_source, *it_seq)) && !(compare_type(*it_seq, *it_source)))
+            for (const CSegment &segment : segments)
             {
-                if (!(compareInside(it_source, it_seq, find_sequence)))
-                    continue;
-                else
-                    set_pos.insert(pos_to_ins);
+                pair<size_t, size_t> range = suffixRange(segment, find_sequence);
+                matches += range.second - range.first;
             }
+            crossingMatches(find_sequence, [&matches](size_t)
+                            { matches++;
+                              return true; });
         }
-        // cout << source_type << endl;
-        return set_pos;
+        else
+            scanMatches(find_sequence, [&matches](size_t)
+                        { matches++;
+                          return true; });
+        CINDEX_COUNT(confirmed, matches);
+        return matches;
     }
-    template <class Iterator>
-    bool compareInside(Iterator it_source, Iterator it_seq, const T_ &find_sequence) const
+
+    /** @returns lowest position of a match, a scan stops at the first one */
+    optional<size_t> findFirst(const T_ &find_sequence) const
     {
-        size_t counter = 0;
-        for (; it_source != source_type.end(); ++it_source, ++it_seq)
+        if (token_index)
         {
+            vector<uint32_t> pattern;
+            return translate(find_sequence, pattern) ? token_index->findFirst(pattern) : nullopt;
+        }
+        if (find_sequence.size() == 0)
+            return source_type.size() ? optional<size_t>(0) : nullopt;
+        CINDEX_TIMED(FIND);
+        if (mode == SUFFIX_ARRAY)
+        {
+            optional<size_t> first;
+            for (size_t index = 0; index < segments.size(); index++) // the segments follow each other in the source
+            {
+                const CSegment &segment = segments[index];
+                pair<size_t, size_t> range = suffixRange(segment, find_sequence);
+                if (range.first != range.second)
+                    first = *min_element(segment.suffix_array + range.first, segment.suffix_array + range.second);
+                crossingMatches(find_sequence, [&first](size_t pos)
+                                { first = min(first.value_or(pos), pos);
+                                  return false; },
+                                index, index + 1);
+                if (first)
+                {
+                    CINDEX_COUNT(confirmed, 1);
+                    return first;
+                }
+            }
+            return nullopt;
+        }
+        optional<size_t> first;
+        scanMatches(find_sequence, [&first](size_t pos)
+                    { first = pos;
+                      return false; });
+        CINDEX_COUNT(confirmed, first.has_value());
+        return first;
+    }
 
-            if (it_seq == find_sequence.end())
+    bool contains(const T_ &find_sequence) const
+    {
+        if (mode == SUFFIX_ARRAY && find_sequence.size() != 0 && !token_index)
+        {
+            CINDEX_TIMED(FIND);
+            for (const CSegment &segment : segments)
             {
-                return true;
+                pair<size_t, size_t> range = suffixRange(segment, find_sequence);
+                if (range.first != range.second)
+                {
+                    CINDEX_COUNT(confirmed, 1);
+                    return true;
+                }
             }
+            if (segments.size() < 2) // the ranges are complete without segment boundaries
+                return false;
+        }
+        return findFirst(find_sequence).has_value();
+    }
 
-            if (it_seq != find_sequence.end() &&
-                (!(compare_type(*it_source, *it_seq)) && !(compare_type(*it_seq, *it_source))))
+    /**
+     * @brief Calls report(pos) for every match in increasing order of pos, nothing is collected in between.
+     *
+     * report may return bool, false stops the search. The scan matchers produce the positions in order already, the
+     * suffix array ranges of the segments (and the matches crossing their boundaries) are collected and sorted first
+     * (O(occ log occ)).
+     */
+    template <typename F_>
+    void forEachMatch(const T_ &find_sequence, F_ report) const
+    {
+        if (token_index)
+        {
+            vector<uint32_t> pattern;
+            if (translate(find_sequence, pattern))
+                token_index->forEachMatch(pattern, report);
+            return;
+        }
+        CINDEX_TIMED(SEARCH);
+        CINDEX_TALLY(reported, confirmed);
+        auto proceed = [&report, &reported](size_t pos)
+        {
+            reported.add(1);
+            if constexpr (is_same<decltype(report(pos)), void>::value)
             {
-                counter++;
-                continue;
+                report(pos);
+                return true;
             }
             else
+                return static_cast<bool>(report(pos));
+        };
+        if (find_sequence.size() == 0)
+        {
+            for (size_t pos = 0; pos < source_type.size(); pos++)
+                if (!proceed(pos))
+                    return;
+            return;
+        }
+        if (mode == SCAN)
+        {
+            scanMatches(find_sequence, proceed);
+            return;
+        }
+        vector<size_t> found;
+        for (const CSegment &segment : segments)
+        {
+            pair<size_t, size_t> range = suffixRange(segment, find_sequence);
+            found.insert(found.end(), segment.suffix_array + range.first, segment.suffix_array + range.second);
+        }
+        crossingMatches(find_sequence, [&found](size_t pos)
+                        { found.push_back(pos);
+                          return true; });
+        sort(found.begin(), found.end());
+        for (size_t pos : found)
+            if (!proceed(pos))
+                return;
+    }
+
+    /**
+     * @brief Appends more to the source, searches report its elements at the positions following the old source.
+     *
+     * The suffix array is kept in segments, like the levels of an LSM tree: more gets a segment of its own, which is
+     * merged with the newest segments while the newest one is not longer than the merged range. The final range is
+     * found from the segment lengths first and its suffix array is built once, not once per merged level. Segment
+     * lengths therefore halve from the oldest one, there are O(log n) of them and every element is rebuilt O(log n)
+     * times over all appends, so an append of k elements costs O(k log^2 n) amortized regardless of the size of the
+     * old source. A single append which merges everything still rebuilds the whole source, O(n log n) in the worst
+     * case. Each segment indexes its suffixes only up to its own end, the matches crossing a
+     * boundary are found by scanning the m - 1 positions in front of it. A SCAN index just extends its source.
+     * Copies of the index are not affected.
+     */
+    void append(const T_ &more)
+    {
+        CINDEX_TIMED(APPEND);
+        if (token_index)
+        {
+            if (token_ids.use_count() > 1) // copy on write, the copies share them
+                token_ids = make_shared<map<value_type, uint32_t, C_>>(*token_ids);
+            if (token_index.use_count() > 1)
+                token_index = make_shared<CIndex<vector<uint32_t>>>(*token_index);
+            vector<uint32_t> tokens;
+            tokens.reserve(more.size());
+            for (const value_type &element : more)
+                tokens.push_back(token_ids->emplace(element, static_cast<uint32_t>(token_ids->size())).first->second);
+            token_index->append(tokens);
+        }
+        size_t old_size = source_type.size();
+        auto it_new = source_type.insert(source_type.end(), more.begin(), more.end());
+        if constexpr (!random_access)
+            for (; it_new != source_type.end(); ++it_new)
+                element_pointers.push_back(&*it_new);
+        if (token_index || mode != SUFFIX_ARRAY || source_type.size() == old_size)
+            return;
+
+        CSegment merged{old_size, source_type.size()};
+        while (!segments.empty() && segments.back().length() <= merged.length()) // the whole cascade at once
+        {
+            merged.begin = segments.back().begin;
+            segments.pop_back();
+        }
+        buildSuffixArray(merged);
+        segments.push_back(move(merged));
+    }
+
+    /**
+     * @brief Positions where the pattern matches with at most k mismatching elements, with the number of mismatches.
+     *
+     * Shift-Add with bit-sliced counters: every pattern position i keeps the mismatch count of the alignment which
+     * currently has its i-th element under the source cursor. The counters are stored vertically, plane p holds bit
+     * p of all of them, 64 pattern positions per machine word and as many words as the pattern needs. For each source
+     * element all planes are shifted by one position (moving every alignment one step on, a new one starts at 0) and
+     * the element's mismatch mask (bit i set if it is not equal to pattern[i] by compare_type) is added with a ripple
+     * carry through the planes. A carry out of the top plane sets a sticky overflow bit, so log2(k) + 2 planes are
+     * enough for any k, and as the counters start at 2^planes - 1 - k the overflow bit alone tells the alignments with
+     * more than k mismatches apart. The counter of position m - 1 belongs to the alignment ending at the element.
+     * That is O(n * (m / 64 + 1) * log k) word operations in one forward pass, independent of the alphabet. Mismatch
+     * masks come from byte_class for char-like elements, otherwise from a map ordered by compare_type.
+     */
+    vector<pair<size_t, size_t>> searchApproximate(const T_ &find_sequence, size_t k) const
+    {
+        CINDEX_TIMED(APPROXIMATE);
+        vector<pair<size_t, size_t>> found; // (position, mismatches)
+        size_t n = source_type.size(), m = find_sequence.size();
+        if (m == 0)
+            for (size_t pos = 0; pos < n; pos++)
+                found.emplace_back(pos, 0);
+        if (m == 0 || m > n)
+            return found;
+
+        size_t words = (m + 63) / 64, planes = 1;
+        while (planes < 64 && (uint64_t(1) << planes) <= k) // the planes count up to k at least
+            planes++;
+        vector<const value_type *> pattern = patternPointers(find_sequence);
+        vector<uint64_t> all_mismatch(words, ~uint64_t(0)), byte_masks;
+        map<value_type, vector<uint64_t>, C_> masks(compare_type);
+        if constexpr (byte_elements)
+        {
+            byte_masks.assign(256 * words, ~uint64_t(0));
+            for (size_t value = 0; value < 256; value++)
+                for (size_t i = 0; i < m; i++)
+                    if (byte_class[value] == byte_class[static_cast<unsigned char>(*pattern[i])])
+                        byte_masks[value * words + i / 64] &= ~(uint64_t(1) << (i % 64));
+        }
+        else
+            for (size_t i = 0; i < m; i++)
+                masks.emplace(*pattern[i], all_mismatch).first->second[i / 64] &= ~(uint64_t(1) << (i % 64));
+
+        // every counter starts at bias instead of 0, so it overflows exactly when the alignment has k + 1 mismatches
+        uint64_t bias = (planes == 64 ? ~uint64_t(0) : (uint64_t(1) << planes) - 1) - k;
+        size_t stride = planes + 1;           // the planes of word w are state[w * stride ...], the last one is overflow
+        vector<uint64_t> state(words * stride, 0);
+        size_t last_word = (m - 1) / 64, last_bit = (m - 1) % 64, pos = 0;
+        for (auto it_source = source_type.begin(); it_source != source_type.end(); ++it_source, ++pos)
+        {
+            const uint64_t *mismatch = all_mismatch.data();
+            if constexpr (byte_elements)
+                mismatch = &byte_masks[static_cast<unsigned char>(*it_source) * words];
+            else
+            {
+                auto it_mask = masks.find(*it_source);
+                if (it_mask != masks.end())
+                    mismatch = it_mask->second.data();
+            }
+            for (size_t w = words; w-- > 0;) // from the top, the shift needs the old bits of the word below
+            {
+                uint64_t *word = &state[w * stride], carry = mismatch[w];
+                for (size_t plane = 0; plane < planes; plane++)
+                {
+                    uint64_t incoming = w ? state[(w - 1) * stride + plane] >> 63 : (bias >> plane) & 1;
+                    uint64_t bits = (word[plane] << 1) | incoming;
+                    word[plane] = bits ^ carry;
+                    carry &= bits;
+                }
+                word[planes] = ((word[planes] << 1) | (w ? state[(w - 1) * stride + planes] >> 63 : 0)) | carry;
+            }
+
+            const uint64_t *word = &state[last_word * stride];
+            if (pos + 1 < m || (word[planes] >> last_bit) & 1)
+                continue;
+            uint64_t counter = 0;
+            for (size_t plane = 0; plane < planes; plane++)
+                counter |= ((word[plane] >> last_bit) & 1) << plane;
+            found.emplace_back(pos + 1 - m, static_cast<size_t>(counter - bias));
+        }
+        return found;
+    }
+
+private:
+    typedef typename T_::value_type value_type;
+    typedef decltype(declval<const T_ &>().begin()) const_iterator; // span has no const_iterator before C++23
+    static constexpr bool random_access = is_base_of<random_access_iterator_tag,
+                                                     typename iterator_traits<const_iterator>::iterator_category>::value;
+    static constexpr size_t min_parallel_chunk = 1 << 16; // shorter chunks cost more in threads than they save
+    static constexpr bool byte_elements = is_integral<value_type>::value && sizeof(value_type) == 1;
+    static constexpr bool contiguous_bytes = byte_elements && (is_same<T_, basic_string<value_type>>::value ||
+                                                               is_same<T_, basic_string_view<value_type>>::value ||
+#if __cplusplus >= 202002L
+                                                               is_same<T_, span<const value_type>>::value ||
+#endif
+                                                               is_same<T_, vector<value_type>>::value);
+
+    struct CSegment
+    {
+        CSegment(size_t begin, size_t end) : begin(begin), end(end) {}
+        size_t length() const { return end - begin; }
+
+        size_t begin, end;                    // the part of the source [begin, end) indexed by the segment
+        const size_t *suffix_array = nullptr; // start positions of its suffixes in lexicographic order
+        const size_t *lcp = nullptr;          // lcp[i] = length of the common prefix of suffixes suffix_array[i - 1] and [i]
+        shared_ptr<const void> storage;       // owns both arrays, built vectors or a mapped snapshot; shared by copies
+    };
+
+    /** @brief index over segments which are built already, see load() */
+    CIndex(T_ &&source, const C_ &compare_type, EMode mode, shared_ptr<const void> owner, vector<CSegment> &&segments)
+        : source_type(move(source)), compare_type(compare_type), mode(mode), owner(move(owner)), segments(move(segments))
+    {
+        buildElementPointers();
+        buildByteClasses();
+    }
+
+    /**
+     * @returns true if the suffix array of segment holds positions of the segment and 64 sampled neighbours in it are
+     * ordered by compare_type with the common prefix stored in lcp
+     */
+    bool validSegment(const CSegment &segment) const
+    {
+        size_t n = segment.length();
+        for (size_t i = 0; i < n; i++)
+            if (segment.suffix_array[i] < segment.begin || segment.suffix_array[i] >= segment.end ||
+                segment.lcp[i] > segment.end - segment.suffix_array[i])
+                return false;
+        for (size_t sample = 1; sample <= 64 && sample < n; sample++)
+        {
+            size_t i = sample * (n - 1) / min<size_t>(64, n - 1);
+            size_t lower = segment.suffix_array[i - 1], upper = segment.suffix_array[i], common = segment.lcp[i];
+            if (common > segment.end - lower)
+                return false;
+            for (size_t offset = 0; offset < common; offset++)
+                if (!equal(elementAt(lower + offset), elementAt(upper + offset)))
+                    return false;
+            if (lower + common == segment.end) // a prefix is lower than the longer suffix
+                continue;
+            if (upper + common == segment.end || !compare_type(elementAt(lower + common), elementAt(upper + common)))
                 return false;
         }
-        if (it_source == source_type.end() && counter != find_sequence.size())
-            return false;
         return true;
     }
 
-private:
+    CIndex(T_ &&source, const C_ &compare_type, EMode mode, shared_ptr<const void> owner, bool intern_tokens)
+        : source_type(move(source)), compare_type(compare_type), mode(mode), owner(move(owner))
+    {
+        buildElementPointers();
+        buildByteClasses();
+        if (intern_tokens)
+            internTokens();
+        else if (mode == SUFFIX_ARRAY)
+        {
+            CINDEX_TIMED(BUILD);
+            segments.push_back(CSegment{0, source_type.size()});
+            buildSuffixArray(segments.back());
+        }
+    }
+
+    /** @brief fills token_ids in the order of the first occurrences and builds token_index over the ids */
+    void internTokens()
+    {
+        auto ids = make_shared<map<value_type, uint32_t, C_>>(compare_type);
+        vector<uint32_t> tokens;
+        tokens.reserve(source_type.size());
+        for (const value_type &element : source_type)
+            tokens.push_back(ids->emplace(element, static_cast<uint32_t>(ids->size())).first->second);
+        token_ids = move(ids);
+        typedef CIndex<vector<uint32_t>> token_index_type;
+        token_index = make_shared<token_index_type>(move(tokens), less<uint32_t>(),
+                                                          static_cast<typename token_index_type::EMode>(mode));
+    }
+
+    /** @returns false if an element of the pattern does not occur in the source, then there is no match */
+    bool translate(const T_ &find_sequence, vector<uint32_t> &pattern) const
+    {
+        pattern.reserve(find_sequence.size());
+        for (const value_type &element : find_sequence)
+        {
+            auto it_id = token_ids->find(element);
+            if (it_id == token_ids->end())
+                return false;
+            pattern.push_back(it_id->second);
+        }
+        return true;
+    }
+
+    /** @brief first part of a snapshot written by save(), 8-byte aligned like all the others */
+    struct CSnapshotHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t byte_order;      // 0x01020304 as written by the saving machine
+        uint64_t element_size;
+        uint64_t element_type;    // hash of typeid(value_type).name()
+        uint64_t comparator_type; // hash of typeid(C_).name()
+        uint64_t mode;
+        uint64_t length;   // number of source elements
+        uint64_t segments; // number of suffix array segments
+        uint64_t checksum; // of the words behind the header
+        array<unsigned char, 256> byte_class;
+    };
+    static constexpr uint32_t snapshot_version = 1;
+
+    static uint64_t hashName(const char *name)
+    {
+        uint64_t hash = 0xcbf29ce484222325; // FNV-1a
+        for (; *name; name++)
+            hash = (hash ^ static_cast<unsigned char>(*name)) * 0x100000001b3;
+        return hash;
+    }
+
+    /** @brief FNV-like hash over whole words, continues from hash */
+    static uint64_t checksum(const uint64_t *words, size_t count, uint64_t hash)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            hash = (hash ^ words[i]) * 0x100000001b3;
+            hash ^= hash >> 29;
+        }
+        return hash;
+    }
+
+    static CSnapshotHeader snapshotHeader(const C_ &, EMode mode, size_t length, size_t segments)
+    {
+        CSnapshotHeader header{};
+        memcpy(header.magic, "CINDEX\0", sizeof(header.magic));
+        header.version = snapshot_version;
+        header.byte_order = 0x01020304;
+        header.element_size = sizeof(value_type);
+        header.element_type = hashName(typeid(value_type).name());
+        header.comparator_type = hashName(typeid(C_).name());
+        header.mode = mode;
+        header.length = length;
+        header.segments = segments;
+        return header;
+    }
+
+    /** @brief contents of the file at path, mapped read-only if possible; nullptr for an empty file */
+    static shared_ptr<const void> readFile(const string &path, size_t &size)
+    {
+#ifdef CINDEX_MMAP
+        int file = open(path.c_str(), O_RDONLY);
+        if (file < 0)
+            throw runtime_error("CIndex: cannot open " + path);
+        struct stat info;
+        if (fstat(file, &info) != 0)
+        {
+            close(file);
+            throw runtime_error("CIndex: cannot stat " + path);
+        }
+        size = static_cast<size_t>(info.st_size);
+        void *data = size == 0 ? nullptr : mmap(nullptr, size, PROT_READ, MAP_PRIVATE, file, 0);
+        close(file); // the mapping keeps the file referenced
+        if (data == MAP_FAILED)
+            throw runtime_error("CIndex: cannot map " + path);
+        if (!data)
+            return nullptr;
+        return shared_ptr<const void>(data, [size](const void *address)
+                                      { munmap(const_cast<void *>(address), size); });
+#else
+        FILE *file = fopen(path.c_str(), "rb");
+        if (!file)
+            throw runtime_error("CIndex: cannot open " + path);
+        auto data = make_shared<vector<uint64_t>>(); // words keep the contents aligned
+        char buffer[1 << 16];
+        string contents;
+        for (size_t got; (got = fread(buffer, 1, sizeof(buffer), file)) > 0;)
+            contents.append(buffer, got);
+        fclose(file);
+        size = contents.size();
+        data->resize((size + 7) / 8);
+        memcpy(data->data(), contents.data(), size);
+        return shared_ptr<const void>(data, data->data());
+#endif /* CINDEX_MMAP */
+    }
+
+    const value_type &elementAt(size_t pos) const
+    {
+        if constexpr (random_access)
+            return source_type.begin()[pos];
+        else
+            return *element_pointers[pos];
+    }
+
+    /** @brief containers without random access (list) get a table of pointers to their elements */
+    void buildElementPointers()
+    {
+        if constexpr (!random_access)
+        {
+            element_pointers.clear();
+            element_pointers.reserve(source_type.size());
+            for (const value_type &element : source_type)
+                element_pointers.push_back(&element);
+        }
+    }
+
+    /** @brief calls task(0 .. tasks - 1) on up to threads threads, the calling one included */
+    static void runParallel(unsigned threads, size_t tasks, const function<void(size_t)> &task)
+    {
+        CWorkerPool::global().run(threads, tasks, task);
+    }
+
+    /**
+     * @brief Runs the linear matcher for the container, report returns false to stop.
+     *
+     * Only matches starting in [from, to) are reported, the source is read up to to + m - 1.
+     */
+    template <typename F_>
+    void scanMatches(const T_ &find_sequence, F_ report, size_t from = 0, size_t to = SIZE_MAX) const
+    {
+        to = min(to, source_type.size());
+        if constexpr (contiguous_bytes)
+            byteSearch(find_sequence, from, to, report);
+        else if constexpr (random_access)
+            horspoolSearch(find_sequence, from, to, report);
+        else
+            kmpSearch(find_sequence, from, to, report);
+    }
+
+    /** @returns [first, last) range of segment.suffix_array whose suffixes start with the non-empty pattern */
+    pair<size_t, size_t> suffixRange(const CSegment &segment, const T_ &find_sequence) const
+    {
+        const size_t *suffix_array = segment.suffix_array;
+        size_t low = 0, high = segment.length(); // first suffix which is not lower than the pattern
+        CINDEX_TALLY(probes, suffix_probes);
+        probes.add(1); // the final check of low
+        while (low < high)
+        {
+            probes.add(1);
+            size_t middle = low + (high - low) / 2;
+            if (comparePrefix(suffix_array[middle], segment.end, find_sequence) < 0)
+                low = middle + 1;
+            else
+                high = middle;
+        }
+        if (low == segment.length() || comparePrefix(suffix_array[low], segment.end, find_sequence) != 0)
+            return {low, low};
+        size_t last = low + 1;
+        while (last < segment.length() && segment.lcp[last] >= find_sequence.size())
+            last++;
+        return {low, last};
+    }
+
+    /**
+     * @brief Reports the matches which start in one of the segments [first, last) and end behind it, unordered.
+     *
+     * Such a match starts in the last m - 1 positions of its segment, which are scanned directly.
+     */
+    template <typename F_>
+    void crossingMatches(const T_ &find_sequence, F_ report, size_t first = 0, size_t last = SIZE_MAX) const
+    {
+        size_t m = find_sequence.size();
+        for (size_t index = first; index < last && index + 1 < segments.size(); index++)
+        {
+            bool proceed = true;
+            const CSegment &segment = segments[index];
+            scanMatches(find_sequence, [&](size_t pos)
+                        { return proceed = report(pos); },
+                        max(segment.begin, segment.end - min(segment.end, m - 1)), segment.end);
+            if (!proceed)
+                return;
+        }
+    }
+
+    bool equal(const value_type &a, const value_type &b) const
+    {
+        return !compare_type(a, b) && !compare_type(b, a);
+    }
+
+    /** @brief pointers to the pattern elements, so that the matchers can index a list pattern too */
+    static vector<const value_type *> patternPointers(const T_ &find_sequence)
+    {
+        vector<const value_type *> pattern;
+        pattern.reserve(find_sequence.size());
+        for (const value_type &element : find_sequence)
+            pattern.push_back(&element);
+        return pattern;
+    }
+
+    /**
+     * @brief Knuth-Morris-Pratt matcher, reports every match starting in [from, to) in increasing order.
+     *
+     * The prefix function of the pattern tells how much of the pattern still matches after a mismatch, so the source
+     * is walked once with forward iterators only, with at most 2 n equality tests: O(n + m).
+     */
+    template <typename F_>
+    void kmpSearch(const T_ &find_sequence, size_t from, size_t to, F_ report) const
+    {
+        vector<const value_type *> pattern = patternPointers(find_sequence);
+        size_t m = pattern.size();
+        vector<size_t> border(m, 0); // border[i] = length of the longest proper border of pattern[0..i]
+        for (size_t i = 1, k = 0; i < m; i++)
+        {
+            while (k > 0 && !equal(*pattern[i], *pattern[k]))
+                k = border[k - 1];
+            if (equal(*pattern[i], *pattern[k]))
+                k++;
+            border[i] = k;
+        }
+
+        auto it_source = source_type.begin();
+        advance(it_source, from);
+        for (size_t pos = from, matched = 0; it_source != source_type.end() && pos < to + m - 1; ++it_source, ++pos)
+        {
+            while (matched > 0 && !equal(*it_source, *pattern[matched]))
+                matched = border[matched - 1];
+            if (equal(*it_source, *pattern[matched]))
+                matched++;
+            if (matched == m)
+            {
+                if (!report(pos + 1 - m))
+                    return;
+                matched = border[m - 1];
+            }
+        }
+    }
+
+    /**
+     * @brief Boyer-Moore-Horspool matcher for random access sources, reports matches in increasing order.
+     *
+     * Each window is compared from its end; afterwards it is shifted by the distance of the window's last element from
+     * the end of the pattern (the whole pattern length if it does not occur there). The shift table is a map ordered by
+     * compare_type, so equivalent elements share their shift; char-like elements copy it into a table indexed by the
+     * byte. On ordinary text most windows are rejected after one comparison and shifted by nearly m. Periodic inputs
+     * ("aaaa" in "aaa...") degrade Horspool to O(n m), so once the comparisons exceed twice the length scanned so far
+     * the rest of the source is handed over to kmpSearch().
+     */
+    template <typename F_>
+    void horspoolSearch(const T_ &find_sequence, size_t from, size_t to, F_ report) const
+    {
+        vector<const value_type *> pattern = patternPointers(find_sequence);
+        size_t n = source_type.size(), m = pattern.size();
+        if (m > n)
+            return;
+        size_t end = min(to, n - m + 1); // start positions are < end
+        map<value_type, size_t, C_> shift(compare_type);
+        for (size_t i = 0; i + 1 < m; i++)
+            shift.insert_or_assign(*pattern[i], m - 1 - i);
+
+        size_t byte_shift[256]; // one byte elements look their shift up directly instead of in the map
+        if constexpr (byte_elements)
+            for (size_t value = 0; value < 256; value++)
+            {
+                auto it_shift = shift.find(static_cast<value_type>(value));
+                byte_shift[value] = it_shift == shift.end() ? m : it_shift->second;
+            }
+
+        size_t work = 0;
+        CINDEX_TALLY(alignments, candidates);
+        for (size_t pos = from; pos < end;)
+        {
+            if (work > 2 * (pos - from + m))
+            {
+                CINDEX_COUNT(kmp_fallbacks, 1);
+                kmpSearch(find_sequence, pos, end, report);
+                return;
+            }
+            alignments.add(1);
+            size_t j = m;
+            while (j > 0 && equal(elementAt(pos + j - 1), *pattern[j - 1]))
+                j--;
+            work += m - j + 1;
+            if (j == 0)
+                if (!report(pos))
+                    return;
+            if constexpr (byte_elements)
+                pos += byte_shift[static_cast<unsigned char>(elementAt(pos + m - 1))];
+            else
+            {
+                auto it_shift = shift.find(elementAt(pos + m - 1));
+                pos += it_shift == shift.end() ? m : it_shift->second;
+            }
+        }
+    }
+
+    /**
+     * @brief byte_class[b] = the lowest byte equal to b by compare_type, for char-like elements only.
+     *
+     * The 256 byte values are sorted by compare_type and split into runs of equal ones, which costs about 2000
+     * comparator calls per index. less<char> gives 256 singleton classes (identity_classes), a case-folding comparator
+     * pairs every letter with its other case.
+     */
+    void buildByteClasses()
+    {
+        if constexpr (byte_elements)
+        {
+            array<unsigned char, 256> order;
+            for (size_t value = 0; value < 256; value++)
+                order[value] = static_cast<unsigned char>(value);
+            auto lower = [this](unsigned char a, unsigned char b)
+            { return compare_type(static_cast<value_type>(a), static_cast<value_type>(b)); };
+            stable_sort(order.begin(), order.end(), lower);
+            identity_classes = true;
+            for (size_t first = 0, last; first < 256; first = last)
+            {
+                unsigned char lowest = order[first];
+                for (last = first + 1; last < 256 && !lower(order[first], order[last]); last++)
+                    lowest = min(lowest, order[last]);
+                identity_classes = identity_classes && last == first + 1;
+                for (size_t i = first; i < last; i++)
+                    byte_class[order[i]] = lowest;
+            }
+        }
+    }
+
+    /** @brief all bytes equal to one pattern byte, with the SIMD test for them */
+    struct CByteSet
+    {
+        CByteSet(const array<unsigned char, 256> &byte_class, unsigned char byte) : count(0)
+        {
+            for (size_t value = 0; value < 256; value++)
+                if (byte_class[value] == byte_class[byte])
+                    members[count++] = static_cast<unsigned char>(value);
+        }
+
+#ifdef CINDEX_SIMD_WIDTH
+#if CINDEX_SIMD_WIDTH == 32
+        typedef __m256i block_type;
+        static block_type load(const unsigned char *data) { return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data)); }
+        static block_type broadcast(unsigned char byte) { return _mm256_set1_epi8(static_cast<char>(byte)); }
+        static block_type equal(block_type a, block_type b) { return _mm256_cmpeq_epi8(a, b); }
+        static block_type both(block_type a, block_type b) { return _mm256_and_si256(a, b); }
+        static block_type either(block_type a, block_type b) { return _mm256_or_si256(a, b); }
+        static uint32_t mask(block_type a) { return static_cast<uint32_t>(_mm256_movemask_epi8(a)); }
+#else
+        typedef __m128i block_type;
+        static block_type load(const unsigned char *data) { return _mm_loadu_si128(reinterpret_cast<const __m128i *>(data)); }
+        static block_type broadcast(unsigned char byte) { return _mm_set1_epi8(static_cast<char>(byte)); }
+        static block_type equal(block_type a, block_type b) { return _mm_cmpeq_epi8(a, b); }
+        static block_type both(block_type a, block_type b) { return _mm_and_si128(a, b); }
+        static block_type either(block_type a, block_type b) { return _mm_or_si128(a, b); }
+        static uint32_t mask(block_type a) { return static_cast<uint32_t>(_mm_movemask_epi8(a)); }
+#endif
+        static constexpr size_t max_simd_members = 8; // larger classes are tested by the scalar loop
+
+        /**
+         * @brief Marks the bytes of block which belong to the set (0xff) or not (0x00).
+         *
+         * Two members differing in one bit (a letter and its other case in ASCII) are folded together by setting
+         * that bit in the whole block first, so case-insensitive search costs one comparison as well.
+         */
+        block_type matches(block_type block) const
+        {
+            unsigned char difference = members[0] ^ members[count - 1];
+            if (count == 2 && (difference & (difference - 1)) == 0)
+                return equal(either(block, broadcast(difference)), broadcast(members[0] | difference));
+            block_type found = equal(block, broadcast(members[0]));
+            for (size_t i = 1; i < count; i++)
+                found = either(found, equal(block, broadcast(members[i])));
+            return found;
+        }
+#endif /* CINDEX_SIMD_WIDTH */
+
+        unsigned char members[256];
+        size_t count;
+    };
+
+    /**
+     * @brief Matcher for strings and vectors of char-like elements, reports matches in increasing order.
+     *
+     * Works on the raw bytes and byte_class, so the comparator is not called at all. With SSE2/AVX2 a block of 16/32
+     * positions is tested at once: the block starting at pos is compared with the first byte of the pattern, the
+     * block starting at pos + m - 1 with the last one, and only the positions where both match are checked byte by
+     * byte (memcmp when the comparator distinguishes all bytes). The remaining positions, and all of them without
+     * SIMD, go through the scalar loop which jumps between occurrences of the first byte with memchr when possible.
+     * Like horspoolSearch(), a scan which spends more than 4 comparisons per position on checks (periodic input and
+     * a long pattern) continues with kmpSearch().
+     */
+    template <typename F_>
+    void byteSearch(const T_ &find_sequence, size_t from, size_t to, F_ report) const
+    {
+        size_t n = source_type.size(), m = find_sequence.size();
+        if (m > n)
+            return;
+        const unsigned char *source = reinterpret_cast<const unsigned char *>(source_type.data());
+        const unsigned char *pattern = reinterpret_cast<const unsigned char *>(find_sequence.data());
+        vector<unsigned char> folded(m); // pattern as byte classes
+        for (size_t i = 0; i < m; i++)
+            folded[i] = byte_class[pattern[i]];
+        CINDEX_TALLY(checked, candidates);
+        auto matchesAt = [&](size_t pos)
+        {
+            checked.add(1);
+            if (identity_classes)
+                return memcmp(source + pos, pattern, m) == 0;
+            for (size_t i = 0; i < m; i++)
+                if (byte_class[source[pos + i]] != folded[i])
+                    return false;
+            return true;
+        };
+
+        CByteSet first(byte_class, pattern[0]), last(byte_class, pattern[m - 1]);
+        size_t pos = from, end = min(to, n - m + 1), work = 0; // start positions are < end
+#ifdef CINDEX_SIMD_WIDTH
+        if (first.count <= CByteSet::max_simd_members && last.count <= CByteSet::max_simd_members)
+            for (; pos + CINDEX_SIMD_WIDTH <= end; pos += CINDEX_SIMD_WIDTH)
+            {
+                uint32_t candidates = CByteSet::mask(CByteSet::both(first.matches(CByteSet::load(source + pos)),
+                                                                    last.matches(CByteSet::load(source + pos + m - 1))));
+                for (; candidates != 0; candidates &= candidates - 1)
+                {
+                    size_t candidate = pos + static_cast<size_t>(__builtin_ctz(candidates));
+                    if (matchesAt(candidate))
+                        if (!report(candidate))
+                            return;
+                    work += m;
+                }
+                if (work > 4 * (pos - from + CINDEX_SIMD_WIDTH))
+                {
+                    CINDEX_COUNT(kmp_fallbacks, 1);
+                    kmpSearch(find_sequence, pos + CINDEX_SIMD_WIDTH, end, report);
+                    return;
+                }
+            }
+#endif /* CINDEX_SIMD_WIDTH */
+
+        for (; pos < end; pos++)
+        {
+            if (first.count == 1)
+            {
+                const void *next = memchr(source + pos, first.members[0], end - pos);
+                if (!next)
+                    return;
+                pos = static_cast<size_t>(static_cast<const unsigned char *>(next) - source);
+            }
+            else if (byte_class[source[pos]] != folded[0])
+                continue;
+            if (matchesAt(pos))
+                if (!report(pos))
+                    return;
+            work += m;
+            if (work > 4 * (pos - from + 1) + m)
+            {
+                CINDEX_COUNT(kmp_fallbacks, 1);
+                kmpSearch(find_sequence, pos + 1, end, report);
+                return;
+            }
+        }
+    }
+
+    /**
+     * @returns < 0 if the suffix at pos (cut at end) is lower than the pattern, 0 if it starts with the pattern, > 0
+     * otherwise
+     */
+    int comparePrefix(size_t pos, size_t end, const T_ &find_sequence) const
+    {
+        for (auto it_seq = find_sequence.begin(); it_seq != find_sequence.end(); ++it_seq, ++pos)
+        {
+            if (pos == end) // the suffix is a proper prefix of the pattern
+                return -1;
+            if (compare_type(elementAt(pos), *it_seq))
+                return -1;
+            if (compare_type(*it_seq, elementAt(pos)))
+                return 1;
+        }
+        return 0;
+    }
+
+    /**
+     * @brief Builds the suffix array and lcp of segment, over its suffixes cut at the end of the segment.
+     *
+     * Elements are ranked first, equal elements (by compare_type) get the same rank. The suffixes are then sorted by
+     * prefix doubling: in round k they are ordered by the pair (rank of the first k elements, rank of the next k
+     * elements) with two passes of counting sort. That is O(n log n) comparisons plus O(n) per round. The LCP array is
+     * computed from the element ranks with Kasai's algorithm in O(n).
+     */
+    void buildSuffixArray(CSegment &segment)
+    {
+        size_t n = segment.length(), begin = segment.begin; // positions are relative to begin until the end
+        auto arrays = make_shared<array<vector<size_t>, 2>>();
+        vector<size_t> &suffix_array = (*arrays)[0], &lcp = (*arrays)[1];
+        suffix_array.resize(n);
+        lcp.assign(n, 0);
+        segment.suffix_array = suffix_array.data();
+        segment.lcp = lcp.data();
+        segment.storage = arrays;
+        if (n == 0)
+            return;
+
+        for (size_t pos = 0; pos < n; pos++)
+            suffix_array[pos] = pos;
+        stable_sort(suffix_array.begin(), suffix_array.end(), [this, begin](size_t a, size_t b)
+                    { return compare_type(elementAt(begin + a), elementAt(begin + b)); });
+        vector<size_t> element_rank(n), rank(n), second(n), count;
+        size_t classes = 1;
+        element_rank[suffix_array[0]] = 0;
+        for (size_t i = 1; i < n; i++)
+        {
+            if (compare_type(elementAt(begin + suffix_array[i - 1]), elementAt(begin + suffix_array[i])))
+                classes++;
+            element_rank[suffix_array[i]] = classes - 1;
+        }
+        rank = element_rank;
+
+        for (size_t k = 1; classes < n; k <<= 1)
+        {
+            size_t filled = 0; // suffixes ordered by their second half, the ones without it first
+            for (size_t pos = n - min(k, n); pos < n; pos++)
+                second[filled++] = pos;
+            for (size_t i = 0; i < n; i++)
+                if (suffix_array[i] >= k)
+                    second[filled++] = suffix_array[i] - k;
+
+            count.assign(classes + 1, 0); // stable counting sort by the first half
+            for (size_t pos = 0; pos < n; pos++)
+                count[rank[pos] + 1]++;
+            for (size_t c = 1; c <= classes; c++)
+                count[c] += count[c - 1];
+            for (size_t i = 0; i < n; i++)
+                suffix_array[count[rank[second[i]]]++] = second[i];
+
+            auto secondRank = [&](size_t pos)
+            { return pos + k < n ? rank[pos + k] + 1 : 0; };
+            second[suffix_array[0]] = 0; // second is reused for the new ranks
+            classes = 1;
+            for (size_t i = 1; i < n; i++)
+            {
+                size_t prev = suffix_array[i - 1], cur = suffix_array[i];
+                if (rank[prev] != rank[cur] || secondRank(prev) != secondRank(cur))
+                    classes++;
+                second[cur] = classes - 1;
+            }
+            rank.swap(second);
+        }
+
+        for (size_t i = 0; i < n; i++) // rank is the inverse of suffix_array now
+            rank[suffix_array[i]] = i;
+        for (size_t pos = 0, common = 0; pos < n; pos++)
+        {
+            if (rank[pos] == 0)
+            {
+                common = 0;
+                continue;
+            }
+            size_t prev = suffix_array[rank[pos] - 1];
+            while (pos + common < n && prev + common < n && element_rank[pos + common] == element_rank[prev + common])
+                common++;
+            lcp[rank[pos]] = common;
+            if (common > 0)
+                common--;
+        }
+        for (size_t &pos : suffix_array)
+            pos += begin;
+    }
+
     T_ source_type;
     C_ compare_type;
+    EMode mode;
+    shared_ptr<const void> owner; // keeps the memory source_type views alive, the mapping of mapFile()
+    /** @brief with intern_tokens: element -> its id, and the index over the source as ids. Shared by the copies */
+    shared_ptr<map<value_type, uint32_t, C_>> token_ids;
+    shared_ptr<CIndex<vector<uint32_t>>> token_index;
+    array<unsigned char, 256> byte_class{}; // see buildByteClasses()
+    bool identity_classes = false;
+    vector<const value_type *> element_pointers;
+    vector<CSegment> segments; // suffix arrays of consecutive parts of the source, see append()
 };
 //=================================================================
 
@@ -113,6 +1700,304 @@ bool upperCaseCompare(const char &a, const char &b)
     return toupper(a) < toupper(b);
 }
 
+#ifdef CINDEX_BENCHMARK
+#include <random>
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+/** @brief benchmark parameters given as key=value arguments, missing keys take the defaults */
+class CBenchmarkArgs
+{
+public:
+    CBenchmarkArgs(int argc, char *argv[])
+    {
+        for (int index = 1; index < argc; index++)
+        {
+            const char *separator = strchr(argv[index], '=');
+            if (!separator)
+            {
+                fprintf(stderr, "expected key=value, got %s\n", argv[index]);
+                exit(EXIT_FAILURE);
+            }
+            values[string(argv[index], separator - argv[index])] = separator + 1;
+        }
+    }
+    bool has(const string &key) const { return values.count(key) != 0; }
+    string text(const string &key, const string &fallback) const
+    {
+        auto it_value = values.find(key);
+        return it_value == values.end() ? fallback : it_value->second;
+    }
+    long long integer(const string &key, long long fallback) const
+    {
+        return has(key) ? atoll(values.at(key).c_str()) : fallback;
+    }
+    double real(const string &key, double fallback) const { return has(key) ? atof(values.at(key).c_str()) : fallback; }
+
+private:
+    map<string, string> values;
+};
+
+/** @brief latencies of single measured calls, summarized as JSON members, only the time inside the calls counts */
+class CLatencies
+{
+public:
+    template <typename F_>
+    void measure(F_ call)
+    {
+        auto begin = chrono::steady_clock::now();
+        call();
+        samples.push_back(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - begin).count());
+    }
+    string json()
+    {
+        sort(samples.begin(), samples.end());
+        double seconds = 0;
+        for (long long sample : samples)
+            seconds += sample / 1e9;
+        auto percentile = [this](double q)
+        { return samples.empty() ? 0 : samples[min(samples.size() - 1, static_cast<size_t>(q * samples.size()))]; };
+        ostringstream json;
+        json << fixed << setprecision(6) << "\"operations\":" << samples.size() << ",\"seconds\":" << seconds
+             << setprecision(0) << ",\"ops_per_second\":" << (seconds > 0 ? samples.size() / seconds : 0.0)
+             << ",\"p50_ns\":" << percentile(0.5) << ",\"p90_ns\":" << percentile(0.9) << ",\"p99_ns\":"
+             << percentile(0.99) << ",\"p999_ns\":" << percentile(0.999) << ",\"max_ns\":"
+             << (samples.empty() ? 0 : samples.back());
+        return json.str();
+    }
+
+private:
+    vector<long long> samples; // nanoseconds per call
+};
+
+/** @returns high water mark of the resident memory of this process in kB, -1 where it is not known */
+long peakMemoryKb()
+{
+#if defined(__unix__) || defined(__APPLE__)
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024; // in bytes there
+#else
+    return usage.ru_maxrss;
+#endif
+#else
+    return -1;
+#endif
+}
+
+/** @brief runs body in a child process where possible, so that every case reports its own peak memory */
+void runIsolated(const function<void()> &body)
+{
+#if defined(__unix__) || defined(__APPLE__)
+    fflush(stdout);
+    pid_t child = fork();
+    if (child == 0)
+    {
+        body();
+        fflush(stdout);
+        _exit(EXIT_SUCCESS);
+    }
+    int status;
+    if (child > 0)
+    {
+        if (waitpid(child, &status, 0) != child || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+        {
+            fprintf(stderr, "benchmark case failed\n");
+            exit(EXIT_FAILURE);
+        }
+        return;
+    }
+#endif
+    body();
+}
+
+/**
+ * @brief Parameters of one synthetic CIndex workload.
+ *
+ * The source is length symbols out of alphabet, uniformly random except that with probability repetitiveness a
+ * block of 32 symbols is copied from an earlier position of the source. A string source spells the symbols as letters
+ * of both cases (then digits and other bytes for alphabets over 52), a list<string> source as words of 3 to 8
+ * letters of both cases. Patterns are pattern symbols long, a fraction hit_rate of them is cut out of the source, the
+ * rest is random. Workload build constructs the index operations times, search and count run operations queries of
+ * searchVector() and count() over 1000 distinct patterns at most. With threads > 1 a search uses the parallel
+ * searchVector(), which splits only scans.
+ */
+struct CIndexWorkload
+{
+    explicit CIndexWorkload(const CBenchmarkArgs &args)
+        : workload(args.text("workload", "search")), source(args.text("source", "string")),
+          comparator(args.text("comparator", "less")), mode(args.text("mode", "sa")),
+          alphabet(args.integer("alphabet", 4)), length(args.integer("length", 1000000)),
+          pattern(args.integer("pattern", 16)), operations(args.integer("operations", 10000)),
+          threads(args.integer("threads", 1)),
+          repetitiveness(args.real("repetitiveness", 0)), hit_rate(args.real("hit_rate", 0.5)),
+          seed(args.integer("seed", 1))
+    {
+        alphabet = max<size_t>(1, min<size_t>(alphabet, 256));
+        pattern = max<size_t>(1, min(pattern, length));
+    }
+
+    void run() const
+    {
+        mt19937 generator(seed);
+        vector<size_t> symbols;
+        symbols.reserve(length);
+        while (symbols.size() < length)
+        {
+            bool copy = symbols.size() >= 32 && generator() % 1000000 < repetitiveness * 1000000;
+            size_t from = copy ? generator() % (symbols.size() - 31) : 0;
+            for (size_t i = 0; i < 32 && symbols.size() < length; i++)
+                symbols.push_back(copy ? symbols[from + i] : generator() % alphabet);
+        }
+        vector<vector<size_t>> queries(min<size_t>(operations, 1000));
+        for (vector<size_t> &query : queries)
+        {
+            size_t from = generator() % (length - pattern + 1);
+            bool hit = generator() % 1000000 < hit_rate * 1000000;
+            for (size_t i = 0; i < pattern; i++)
+                query.push_back(hit ? symbols[from + i] : generator() % alphabet);
+        }
+
+        if (source == "list")
+        {
+            vector<string> words(alphabet);
+            for (string &word : words)
+            {
+                word.resize(3 + generator() % 6);
+                for (char &letter : word)
+                    letter = (generator() % 2 ? 'a' : 'A') + generator() % 26;
+            }
+            auto spell = [&words](const vector<size_t> &sequence)
+            {
+                list<string> spelled;
+                for (size_t symbol : sequence)
+                    spelled.push_back(words[symbol]);
+                return spelled;
+            };
+            if (comparator == "nocase" || comparator == "exact")
+                measure(spell(symbols), spell, queries, CStrComparator(comparator == "nocase"));
+            else
+                measure(spell(symbols), spell, queries, less<string>());
+        }
+        else
+        {
+            static const string letters = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+            auto spell = [](const vector<size_t> &sequence)
+            {
+                string spelled;
+                for (size_t symbol : sequence)
+                    spelled.push_back(symbol < letters.size() ? letters[symbol] : static_cast<char>(symbol));
+                return spelled;
+            };
+            typedef bool (*char_order)(const char &, const char &);
+            if (comparator == "upper")
+                measure(spell(symbols), spell, queries, static_cast<char_order>(upperCaseCompare));
+            else
+                measure(spell(symbols), spell, queries, less<char>());
+        }
+    }
+
+    template <typename T_, typename F_, typename C_>
+    void measure(const T_ &text, F_ spell, const vector<vector<size_t>> &queries, const C_ &compare) const
+    {
+        typedef CIndex<T_, C_> index_type;
+        typename index_type::EMode index_mode = mode == "scan" ? index_type::SCAN : index_type::SUFFIX_ARRAY;
+        CLatencies latencies;
+        size_t matches = 0;
+        if (workload == "build")
+            for (size_t build = 0; build < operations; build++)
+                latencies.measure([&]()
+                                  { index_type index(text, compare, index_mode);
+                                    matches += index.count(spell(queries[0])); });
+        else
+        {
+            vector<T_> patterns;
+            for (const vector<size_t> &query : queries)
+                patterns.push_back(spell(query));
+            index_type index(text, compare, index_mode);
+            for (size_t query = 0; query < operations; query++)
+            {
+                const T_ &find_sequence = patterns[query % patterns.size()];
+                if (workload == "count")
+                    latencies.measure([&]() { matches += index.count(find_sequence); });
+                else if (threads > 1)
+                    latencies.measure([&]() { matches += index.searchVector(find_sequence, threads).size(); });
+                else
+                    latencies.measure([&]() { matches += index.searchVector(find_sequence).size(); });
+            }
+        }
+        printf("{\"benchmark\":\"du7\",\"workload\":\"%s\",\"source\":\"%s\",\"comparator\":\"%s\",\"mode\":\"%s\","
+               "\"alphabet\":%zu,\"length\":%zu,\"pattern\":%zu,\"repetitiveness\":%g,\"hit_rate\":%g,\"threads\":%zu,"
+               "\"seed\":%u,%s,\"matches\":%zu,\"peak_rss_kb\":%ld}\n",
+               workload.c_str(), source.c_str(), comparator.c_str(), mode.c_str(), alphabet, length, pattern,
+               repetitiveness, hit_rate, threads, seed, latencies.json().c_str(), matches, peakMemoryKb());
+    }
+
+    string workload, source, comparator, mode;
+    size_t alphabet, length, pattern, operations, threads;
+    double repetitiveness, hit_rate;
+    unsigned seed;
+};
+
+/**
+ * @brief Benchmark driver, prints one JSON object per case and line.
+ *
+ * Parameters are key=value arguments: workload (build, search, count), source (string, list), comparator (less and
+ * upper for strings, less, nocase and exact for lists), mode (sa, scan), alphabet, length, pattern, repetitiveness,
+ * hit_rate, threads, operations and seed. With a workload only that case runs, without one a fixed matrix of the cases runs,
+ * each in a process of its own. The same seed gives the same source and patterns.
+ */
+int main(int argc, char *argv[])
+{
+    CBenchmarkArgs args(argc, argv);
+    CIndexWorkload base(args);
+    vector<CIndexWorkload> cases;
+    auto add = [&](const char *workload, const char *source, const char *comparator, const char *mode,
+                   size_t alphabet, double repetitiveness)
+    {
+        cases.push_back(base);
+        CIndexWorkload &added = cases.back();
+        added.workload = workload;
+        added.source = source;
+        added.comparator = comparator;
+        added.mode = mode;
+        added.alphabet = alphabet;
+        added.repetitiveness = repetitiveness;
+        if (!args.has("operations"))
+            added.operations = added.workload == "build" ? 3 : added.mode == "scan" ? 200 : 10000;
+        if (!args.has("length") && added.source == "list")
+            added.length = 200000;
+    };
+    if (args.has("workload"))
+        cases.push_back(base);
+    else
+        for (double repetitiveness : {0.0, 0.9})
+        {
+            for (const char *workload : {"build", "search", "count"})
+                add(workload, "string", "less", "sa", 4, repetitiveness);
+            add("search", "string", "less", "sa", 26, repetitiveness);
+            add("search", "string", "upper", "sa", 52, repetitiveness);
+            add("search", "string", "less", "scan", 4, repetitiveness);
+            add("search", "string", "upper", "scan", 52, repetitiveness);
+            for (const char *comparator : {"less", "nocase", "exact"})
+                add("search", "list", comparator, "sa", 1000, repetitiveness);
+            add("search", "list", "less", "scan", 1000, repetitiveness);
+        }
+    if (!args.has("workload"))
+        for (size_t threads : {2, 4, 8, 16}) // scaling of the parallel scan against the threads = 1 case above
+        {
+            add("search", "string", "less", "scan", 4, 0);
+            cases.back().threads = threads;
+        }
+    for (const CIndexWorkload &workload : cases)
+        runIsolated([&workload]() { workload.run(); });
+    return EXIT_SUCCESS;
+}
+#else
 int main(void)
 {
     CIndex<string> t0("abcabcabc");
@@ -194,6 +2079,188 @@ int main(void)
     set<size_t> r26 = t7.search(list<string>{"test", "this"});
     assert(r26 == (set<size_t>{2, 5}));
 
+    CIndex<string> t8("aaaaaaau aaauaaaau", less<char>(), CIndex<string>::SCAN);
+    assert(t8.search("aa") == r8);
+    assert(t8.search("aaaa") == r10);
+    assert(t8.search("aaau") == (set<size_t>{4, 9, 14}));
+    assert(t8.search("aaaaaaau aaauaaaau!") == (set<size_t>{}));
+    CIndex<string, bool (*)(const char &, const char &)> t9(
+        "automatIc authentication automotive auTOmation raut", upperCaseCompare,
+        CIndex<string, bool (*)(const char &, const char &)>::SCAN);
+    assert(t9.search("auto") == r17);
+    assert(t9.search("tic") == r19);
+    CIndex<list<string>, CStrComparator> t10(
+        list<string>{"Hello", "world", "test", "this", "foo", "TEsT", "this", "done"}, CStrComparator(true),
+        CIndex<list<string>, CStrComparator>::SCAN);
+    assert(t10.search(list<string>{"test", "this"}) == r26);
+    CIndex<list<string>, CStrComparator> t17(
+        list<string>{"Hello", "world", "test", "this", "foo", "TEsT", "this", "done"}, CStrComparator(true),
+        CIndex<list<string>, CStrComparator>::SUFFIX_ARRAY, true);
+    assert(t17.search(list<string>{"test", "this"}) == r26 && t17.search(list<string>{"TEST"}) == r26);
+    assert(t17.search(list<string>{"this", "missing"}).empty() && t17.count(list<string>{}) == 8);
+    CIndex<vector<string>, CStrComparator> t18(
+        vector<string>{"Hello", "world", "test", "this", "foo", "TEsT", "this", "done"}, CStrComparator(false),
+        CIndex<vector<string>, CStrComparator>::SCAN, true);
+    assert(t18.search(vector<string>{"test", "this"}) == (set<size_t>{2}) && t18.findFirst(vector<string>{"this"}) == 3);
+
+    CIndex<string> t19("kokoko");
+    CIndex<string> t20 = t19;
+    for (const char *part : {"kosk", "o", "kos", "o", "kos"})
+        t19.append(part);
+    assert(t19.search("kos") == r6 && t19.search("kokos") == r7 && t19.count("ko") == 7);
+    assert(t19.findFirst("sk") == 8 && t19.contains("osok") && !t19.contains("kk"));
+    assert(t20.search("kos").empty() && t20.count("") == 6);
+    assert(t2.searchApproximate("kos", 1) ==
+           (vector<pair<size_t, size_t>>{{0, 1}, {2, 1}, {4, 1}, {6, 0}, {9, 1}, {11, 0}, {15, 0}}));
+    assert(t2.searchApproximate("kos", 0).size() == 3 && t2.searchApproximate("kokokokoskokosokosx", 5).empty());
+    assert(t5.searchApproximate("auto", 1) == (vector<pair<size_t, size_t>>{{0, 0}, {10, 1}, {25, 0}, {36, 0}}));
+    assert(t7.searchApproximate(list<string>{"test", "foo"}, 1) == (vector<pair<size_t, size_t>>{{2, 1}, {3, 1}, {5, 1}}));
+    t17.append(list<string>{"TEST", "This"});
+    assert(t17.search(list<string>{"test", "this"}) == (set<size_t>{2, 5, 8}));
+
+    assert(t3.searchVector("aaaa") == (vector<size_t>{0, 1, 2, 3, 13}));
+    assert(t8.searchVector("aaaa") == (vector<size_t>{0, 1, 2, 3, 13}));
+    assert(t3.searchBitmap("aaau") == t8.searchBitmap("aaau"));
+    assert(t3.searchBitmap("aaau")[9] && !t3.searchBitmap("aaau")[10]);
+    assert(t3.count("aa") == 11 && t8.count("aa") == 11 && t3.count("") == 18 && t3.count("b") == 0);
+    assert(t3.findFirst("aaau") == optional<size_t>(4) && t8.findFirst("aaau") == optional<size_t>(4));
+    assert(!t4.findFirst("trunk") && !t9.contains("trunk") && t5.contains("AUTO"));
+    size_t visited = 0;
+    t7.forEachMatch(list<string>{"this"}, [&visited](size_t pos)
+                    { visited += pos; });
+    assert(visited == 3 + 6);
+    vector<size_t> firstTwo;
+    t0.forEachMatch("abc", [&firstTwo](size_t pos)
+                    { firstTwo.push_back(pos);
+                      return firstTwo.size() < 2; });
+    assert(firstTwo == (vector<size_t>{0, 3}));
+
+    vector<vector<size_t>> r27 = t3.searchAll(vector<string>{"aaaa", "u", "aaau", "", "x", "aaaa"});
+    assert(r27.size() == 6 && r27[0] == t3.searchVector("aaaa") && r27[5] == r27[0]);
+    assert(r27[1] == (vector<size_t>{7, 12, 17}) && r27[2] == (vector<size_t>{4, 9, 14}));
+    assert(r27[3].size() == 18 && r27[4].empty());
+    CPatternSet<string, bool (*)(const char &, const char &)> keywords(vector<string>{"AUTO", "tic", "ion"},
+                                                                      upperCaseCompare);
+    vector<vector<size_t>> r28 = t5.searchAll(keywords);
+    assert(r28[0] == (vector<size_t>{0, 25, 36}) && r28[1] == (vector<size_t>{6, 16}) && r28[2] == (vector<size_t>{21, 43}));
+    assert(keywords.search("Tic-tac-toe")[1] == (vector<size_t>{0}));
+    vector<vector<size_t>> r29 = t7.searchAll(vector<list<string>>{{"test", "this"}, {"THIS"}});
+    assert(r29[0] == (vector<size_t>{2, 5}) && r29[1] == (vector<size_t>{3, 6}));
+
+    string repeated;
+    for (size_t i = 0; i < 20000; i++)
+        repeated += "aaaaaaau aaauaaaau";
+    CIndex<string> t11(repeated, less<char>(), CIndex<string>::SCAN);
+    for (const char *pattern : {"aa", "aaau", "u aaauaaaau aaaaaaau", "aaaaaaaa"})
+        assert(t11.searchVector(pattern, 4) == t11.searchVector(pattern));
+    assert(t11.search("uaaaau", 3) == t11.search("uaaaau"));
+    vector<thread> searchers; // the pool runs one search at a time, the others wait for it
+    for (unsigned threads = 2; threads <= 5; threads++)
+        searchers.emplace_back([&t11, threads]()
+                               { for (int repeat = 0; repeat < 20; repeat++)
+                                     assert(t11.searchVector("aau", threads) == t11.searchVector("aau")); });
+    for (auto &searcher : searchers)
+        searcher.join();
+    string long_pattern = repeated.substr(5, 100);
+    long_pattern[0] = long_pattern[70] = long_pattern[99] = 'x';
+    vector<pair<size_t, size_t>> r30 = t11.searchApproximate(long_pattern, 3);
+    assert(r30.size() == 19995 && r30[0] == (pair<size_t, size_t>{5, 3}) && r30[1] == (pair<size_t, size_t>{23, 3}));
+
+    CIndex<string_view> t12(string_view(repeated).substr(0, 18 * 3), less<char>(), CIndex<string_view>::SCAN);
+    assert(t12.search("aaaa") == (set<size_t>{0, 1, 2, 3, 13, 18, 19, 20, 21, 31, 36, 37, 38, 39, 49}));
+    CIndex<string_view, bool (*)(const char &, const char &)> t13("automatIc authentication automotive auTOmation raut",
+                                                                  upperCaseCompare);
+    assert(t13.search("auto") == r17 && t13.search("tic") == r19);
+#ifdef CINDEX_MMAP
+    const char *mapped_path = "DU7_mapped.tmp";
+    FILE *mapped_file = fopen(mapped_path, "w");
+    assert(mapped_file && fputs("kokokokoskokosokos", mapped_file) >= 0 && fclose(mapped_file) == 0);
+    CIndex<string_view> t14 = CIndex<string_view>::mapFile(mapped_path);
+    {
+        CIndex<string_view> t15 = CIndex<string_view>::mapFile(mapped_path, less<char>(), CIndex<string_view>::SCAN);
+        t14 = t15; // the mapping of t15 outlives it, the one of t14 is released here
+    }
+    assert(remove(mapped_path) == 0);
+    assert(t14.search("kos") == r6 && t14.search("kokos") == r7);
+    bool thrown = false;
+    try
+    {
+        CIndex<string_view>::mapFile(mapped_path);
+    }
+    catch (const runtime_error &)
+    {
+        thrown = true;
+    }
+    assert(thrown);
+#endif /* CINDEX_MMAP */
+    auto loadFails = [](auto load)
+    {
+        try
+        {
+            load();
+        }
+        catch (const runtime_error &)
+        {
+            return true;
+        }
+        return false;
+    };
+    const char *snapshot_path = "DU7_snapshot.tmp";
+    t19.save(snapshot_path);
+    CIndex<string_view> t21 = CIndex<string_view>::load(snapshot_path);
+    CIndex<string> t22 = CIndex<string>::load(snapshot_path);
+    assert(t21.search("kos") == r6 && t21.search("kokos") == r7 && t22.count("ko") == 7 && t22.contains("osok"));
+    t22.append("kos");
+    assert(t22.search("kos") == (set<size_t>{6, 11, 15, 18}));
+    assert(loadFails([&]() { CIndex<vector<int>>::load(snapshot_path); }));
+    assert(loadFails([&]() { CIndex<string, greater<char>>::load(snapshot_path, greater<char>()); }));
+    FILE *snapshot_file = fopen(snapshot_path, "r+b");
+    assert(snapshot_file && fseek(snapshot_file, -3, SEEK_END) == 0 && fputc('x', snapshot_file) != EOF &&
+           fclose(snapshot_file) == 0);
+    assert(loadFails([&]() { CIndex<string>::load(snapshot_path); }));
+    typedef bool (*char_order)(const char &, const char &);
+    char_order ascending = [](const char &a, const char &b) { return a < b; };
+    char_order descending = [](const char &a, const char &b) { return a > b; };
+    typedef CIndex<string, char_order> ordered_index;
+    t5.save(snapshot_path);
+    assert(ordered_index::load(snapshot_path, upperCaseCompare).search("auto") == r17);
+    assert(loadFails([&]() { ordered_index::load(snapshot_path, ascending); }));
+    ordered_index(string("kokokokoskokosokos"), ascending).save(snapshot_path);
+    assert(loadFails([&]() { ordered_index::load(snapshot_path, descending); }));
+    CIndex<vector<int>> t24(vector<int>{1, 2, 3, 1, 2, 3, 4});
+    t24.save(snapshot_path);
+    assert(CIndex<vector<int>>::load(snapshot_path).searchVector(vector<int>{2, 3}) == (vector<size_t>{1, 4}));
+    assert(remove(snapshot_path) == 0);
+    assert(loadFails([&]() { CIndex<string>::load(snapshot_path); }));
+
+    CIndexMetrics local_metrics;
+    for (uint64_t elapsed : {0, 1, 100, 1000})
+        local_metrics.record(CIndexMetrics::SEARCH, elapsed);
+    CIndexMetrics::CSnapshot r31 = local_metrics.snapshot();
+    assert(r31.calls[CIndexMetrics::SEARCH] == 4 && r31.nanoseconds[CIndexMetrics::SEARCH] == 1101);
+    assert(r31.latency[CIndexMetrics::SEARCH][7] == 1 && r31.quantile(CIndexMetrics::SEARCH, 0.5) == 127);
+    assert(r31.quantile(CIndexMetrics::SEARCH, 0.1) == 0 && r31.quantile(CIndexMetrics::SEARCH, 0.99) == 1023);
+    CIndexMetrics::CSnapshot before = CIndexMetrics::global().snapshot();
+    CIndex<string> t25("abracadabra");
+    assert(t25.count("abra") == 2 && t25.search("bra") == (set<size_t>{1, 8}) && !t25.contains("cab"));
+    CIndexMetrics::CSnapshot after = CIndexMetrics::global().snapshot();
+#ifdef CINDEX_METRICS
+    assert(after.calls[CIndexMetrics::BUILD] == before.calls[CIndexMetrics::BUILD] + 1);
+    assert(after.calls[CIndexMetrics::COUNT] == before.calls[CIndexMetrics::COUNT] + 1 &&
+           after.calls[CIndexMetrics::SEARCH] == before.calls[CIndexMetrics::SEARCH] + 1 &&
+           after.calls[CIndexMetrics::FIND] == before.calls[CIndexMetrics::FIND] + 1);
+    assert(after.confirmed == before.confirmed + 4 && after.suffix_probes > before.suffix_probes);
+#else
+    assert(after.calls[CIndexMetrics::SEARCH] == before.calls[CIndexMetrics::SEARCH] && after.confirmed == 0 &&
+           after.suffix_probes == 0);
+#endif /* CINDEX_METRICS */
+    assert(CIndexMetrics::global().exportText().find("cindex_search_ns_count ") != string::npos);
+#if __cplusplus >= 202002L
+    CIndex<span<const char>> t16(span<const char>(repeated.data(), 18 * 3));
+    assert(t16.searchVector(span<const char>("uaaaau", 6)) == (vector<size_t>{12, 30, 48}));
+#endif
+
     return 0;
 }
+#endif /* CINDEX_BENCHMARK */
 #endif /* __PROGTEST__ */